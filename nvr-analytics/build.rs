@@ -1,4 +1,5 @@
 fn main() -> Result<(), Box<dyn std::error::Error>> {
     tonic_build::compile_protos("src/inferencer.proto")?;
+    tonic_build::compile_protos("src/backfill.proto")?;
     Ok(())
 }
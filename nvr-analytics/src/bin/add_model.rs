@@ -0,0 +1,136 @@
+//! Packs a TensorFlow Lite object detection model and its labels into a `ModelData` message for
+//! `inferencer_server`, writing it to a `--model-dir` directory and/or a database's
+//! `object_detection_model` table. A running server picks it up on SIGHUP.
+
+use failure::{Error, bail, format_err};
+use prost::Message;
+use rusqlite::params;
+use std::collections::HashMap;
+use structopt::StructOpt;
+
+mod proto {
+    tonic::include_proto!("org.moonfire_nvr.inferencer");
+}
+
+#[derive(StructOpt)]
+struct Opt {
+    /// The model's uuid, which clients use to select it.
+    #[structopt(long)]
+    uuid: uuid::Uuid,
+
+    /// A human-readable name for the model.
+    #[structopt(long)]
+    name: String,
+
+    /// The model compiled for the Edge TPU.
+    #[structopt(long, parse(from_os_str))]
+    edgetpu_model: Option<std::path::PathBuf>,
+
+    /// The model for CPU interpreters.
+    #[structopt(long, parse(from_os_str))]
+    cpu_model: Option<std::path::PathBuf>,
+
+    /// The labels, one per line: a numeric id, whitespace, and a name, as in the label files
+    /// published with the Coral models.
+    #[structopt(long, parse(from_os_str))]
+    labels: std::path::PathBuf,
+
+    /// The model's input width, in pixels.
+    #[structopt(long)]
+    width: u32,
+
+    /// The model's input height, in pixels.
+    #[structopt(long)]
+    height: u32,
+
+    /// A directory to write `<uuid>.model` to.
+    #[structopt(long, parse(from_os_str))]
+    dir: Option<std::path::PathBuf>,
+
+    /// A database to add the model to, or update it in.
+    #[structopt(long, parse(from_os_str))]
+    db: Option<std::path::PathBuf>,
+}
+
+fn parse_labels(labels: &str) -> Result<HashMap<u32, String>, Error> {
+    let mut out = HashMap::new();
+    for (i, line) in labels.lines().enumerate() {
+        let line = line.trim();
+        if line.is_empty() {
+            continue;
+        }
+        let mut parts = line.splitn(2, char::is_whitespace);
+        let id = parts.next().unwrap().parse()
+            .map_err(|e| format_err!("labels line {}: bad id: {}", i + 1, e))?;
+        let name = parts.next().map(str::trim).unwrap_or("");
+        if name.is_empty() {
+            bail!("labels line {}: missing name", i + 1);
+        }
+        out.insert(id, name.to_owned());
+    }
+    Ok(out)
+}
+
+fn main() -> Result<(), Error> {
+    let mut h = nvr_analytics::init_logging();
+    let _a = h.async_scope();
+    let opt = Opt::from_args();
+    if opt.edgetpu_model.is_none() && opt.cpu_model.is_none() {
+        bail!("at least one of --edgetpu-model and --cpu-model is required");
+    }
+    if opt.dir.is_none() && opt.db.is_none() {
+        bail!("at least one of --dir and --db is required");
+    }
+    let read = |p: &Option<std::path::PathBuf>| match p {
+        None => Ok(Vec::new()),
+        Some(p) => std::fs::read(p),
+    };
+    let m = proto::ModelData {
+        name: opt.name.clone(),
+        r#type: proto::ModelType::ModelObjectDetection as i32,
+        input_parameters: Some(proto::ImageParameters {
+            pixel_format: proto::PixelFormat::Rgb24 as i32,
+            width: opt.width,
+            height: opt.height,
+        }),
+        labels: parse_labels(&std::fs::read_to_string(&opt.labels)?)?,
+        edgetpu_model: read(&opt.edgetpu_model)?,
+        cpu_model: read(&opt.cpu_model)?,
+    };
+    let mut data = Vec::with_capacity(m.encoded_len());
+    m.encode(&mut data)?;
+
+    if let Some(dir) = opt.dir.as_ref() {
+        // Write then rename, so a reloading server never sees a partial file.
+        let name = format!("{}.model", opt.uuid.to_hyphenated());
+        let tmp = dir.join(format!(".{}.tmp", name));
+        std::fs::write(&tmp, &data)?;
+        std::fs::rename(&tmp, dir.join(&name))?;
+    }
+    if let Some(db) = opt.db.as_ref() {
+        let mut conn = nvr_analytics::db::open(db)?;
+        let tx = conn.transaction()?;
+        let u = opt.uuid.as_bytes();
+        let updated = tx.execute(r#"
+            update object_detection_model set name = ?, data = ? where uuid = ?
+        "#, params![&opt.name, &data, &u[..]])?;
+        if updated == 0 {
+            tx.execute(r#"
+                insert into object_detection_model (uuid, name, data) values (?, ?, ?)
+            "#, params![&u[..], &opt.name, &data])?;
+        }
+        tx.commit()?;
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    #[test]
+    fn parse_labels() {
+        let l = super::parse_labels("0  person\n1  bicycle\n\n87  teddy bear\n").unwrap();
+        assert_eq!(l.len(), 3);
+        assert_eq!(l[&87], "teddy bear");
+        super::parse_labels("person\n").unwrap_err();
+    }
+}
@@ -1,15 +1,46 @@
 //! Runs video analytics over the entire corpus.
 //! Currently doesn't actually do anything with them; just getting the workflow down.
 //! TODO: keep state.
+//!
+//! Work flows through a pipeline of stages connected by bounded channels:
+//!
+//! 1.  a fetch thread, which downloads recordings and sends them to `decode_tx`.
+//! 2.  decoder workers (on the rayon pool), which demux, decode, and scale the selected frames
+//!     of a recording, take an idle interpreter from `idle_rx`, fill its input tensor, and send
+//!     it to `frame_tx`. With `--motion-threshold`, frames which haven't changed since the last
+//!     analyzed one skip the remaining stages and reuse its detections.
+//! 3.  invoke threads, which invoke each filled interpreter, encode the detections via
+//!     `append_frame`, and return the interpreter to `idle_tx`. There are two interpreters per
+//!     Edge TPU, so one can be filled while the other is invoking. Frames of a recording may be
+//!     spread across interpreters; they're put back in order as they complete.
+//! 4.  a writer thread, which compresses and inserts each finished recording.
+//!
+//! This keeps the decoders busy while every interpreter is invoking, so throughput is limited
+//! by the slowest stage rather than the sum of them. To find which stage that is, each is timed
+//! (see `Stage`) and the queues between them are sampled; a summary is logged at exit, and
+//! `--trace-file` writes a timeline for `chrome://tracing` or <https://ui.perfetto.dev/>.
+//!
+//! With `--detect-interval`, decoders run the detector on only some frames and carry boxes
+//! forward with a `Tracker` in between, as `webvtt_standalone` does. Whether a frame needs the
+//! detector depends on the previous detections, which come back from an invoke thread, so
+//! at each analyzed frame the decoder first waits for the recording's last detections (if
+//! still in flight). Other recordings' decoders keep the interpreters busy meanwhile.
 
 use cstr::*;
 use failure::{Error, bail, format_err};
-use log::{info, trace};
+use futures::StreamExt;
+use crossbeam::channel::RecvTimeoutError;
+use log::{debug, error, info, trace, warn};
 use moonfire_ffmpeg::avutil::VideoFrame;
+use nvr_analytics::metrics::Metrics;
+use nvr_analytics::streaming::StreamingBody;
+use nvr_analytics::track::Tracker;
+use nvr_analytics::webvtt::Object;
+use nvr_analytics::work_queue::{Analyzed, Queue, StreamKey};
 use rayon::prelude::*;
-use rusqlite::params;
 use std::convert::TryFrom;
 use std::sync::{Arc, atomic::{AtomicUsize, Ordering}};
+use std::time::Instant;
 use structopt::StructOpt;
 use uuid::Uuid;
 
@@ -21,8 +52,20 @@ struct Opt {
     #[structopt(short, long, parse(try_from_str))]
     nvr: reqwest::Url,
 
+    /// The database to write results to, which also holds the work queue. Exactly one of this
+    /// and `--coordinator` is required.
     #[structopt(short, long, parse(from_os_str))]
-    db: std::path::PathBuf,
+    db: Option<std::path::PathBuf>,
+
+    /// The URL of a `backfill --listen` process to get work from and send results to, as for
+    /// a worker on another machine than the database.
+    #[structopt(long)]
+    coordinator: Option<String>,
+
+    /// Serve `--db`'s work queue to `--coordinator` workers on this address, such as
+    /// `0.0.0.0:50052`. The service isn't authenticated, so listen only on a trusted network.
+    #[structopt(long)]
+    listen: Option<std::net::SocketAddr>,
 
     #[structopt(short, long, parse(try_from_str))]
     start: Option<moonfire_nvr_client::Time>,
@@ -35,10 +78,166 @@ struct Opt {
 
     #[structopt(short="C", long, use_delimiter=true)]
     cameras: Option<Vec<String>>,
+
+    /// How to choose frames to decode: "all" or "fast".
+    ///
+    /// "all" decodes every frame and analyzes the first at or after each multiple of the
+    /// interval. "fast" decides before decoding: when the interval is at least a GOP, it decodes
+    /// only keyframes, analyzing the first keyframe at or after each multiple of the interval;
+    /// otherwise it has the decoder discard non-reference frames. This analyzes slightly
+    /// different frames than "all" but is much cheaper at low `--fps`.
+    #[structopt(long, default_value="all", parse(try_from_str))]
+    frame_selection: FrameSelection,
+
+    /// Reuse the previous detections for selected frames whose luma differs from the last
+    /// analyzed frame's by at most this much per pixel (averaged over each 16x16 block), rather
+    /// than scaling and invoking. 0 analyzes every selected frame.
+    #[structopt(long, default_value="0")]
+    motion_threshold: u8,
+
+    /// Track objects, running the detector only on every this many analyzed frames (or sooner,
+    /// once a track's position becomes uncertain) and storing the tracks' predicted boxes for
+    /// the frames in between. `frame_data` has no field for track ids, so they aren't stored.
+    #[structopt(long)]
+    detect_interval: Option<u32>,
+
+    /// The maximum number of `view.mp4` requests to have in flight at once.
+    #[structopt(long, default_value="4")]
+    fetch_concurrency: usize,
+
+    /// Commit once this many recordings are waiting to be written.
+    #[structopt(long, default_value="64")]
+    commit_rows: usize,
+
+    /// Commit once the oldest waiting recording has waited this many milliseconds.
+    #[structopt(long, default_value="1000")]
+    commit_interval_ms: u64,
+
+    /// A name for this process in the work queue, unique among all the workers sharing it.
+    /// Defaults to the hostname, pid, and start time.
+    #[structopt(long)]
+    worker_id: Option<String>,
+
+    /// How long a claim on a recording lasts without renewal. Another process may reclaim it
+    /// after this long if this one dies.
+    #[structopt(long, default_value="300")]
+    lease_secs: u64,
+
+    /// The number of recordings to claim from the work queue at once.
+    #[structopt(long, default_value="64")]
+    claim_batch: usize,
+
+    /// The zstd compression level for `frame_data`.
+    #[structopt(long, default_value="3")]
+    zstd_level: i32,
+
+    /// The id of the `zstd_dictionary` to compress `frame_data` with. Defaults to the newest.
+    #[structopt(long)]
+    zstd_dictionary: Option<i64>,
+
+    /// Compress `frame_data` without a dictionary, even if one is available.
+    #[structopt(long)]
+    no_zstd_dictionary: bool,
+
+    /// Run until killed, annotating new recordings as they're committed, ahead of backfill work.
+    #[structopt(long)]
+    follow: bool,
+
+    /// When following, how often to look for new recordings.
+    #[structopt(long, default_value="5")]
+    poll_secs: u64,
+
+    /// Write a Chrome trace of every stage's timing to this file on exit. This keeps every event
+    /// in RAM, so it's best used on short runs.
+    #[structopt(long, parse(from_os_str))]
+    trace_file: Option<std::path::PathBuf>,
+}
+
+#[derive(Copy, Clone, Debug, Eq, PartialEq)]
+enum FrameSelection {
+    All,
+    Fast,
+}
+
+impl std::str::FromStr for FrameSelection {
+    type Err = Error;
+
+    fn from_str(s: &str) -> Result<Self, Error> {
+        match s {
+            "all" => Ok(FrameSelection::All),
+            "fast" => Ok(FrameSelection::Fast),
+            _ => bail!("unknown frame selection {:?}; expected \"all\" or \"fast\"", s),
+        }
+    }
+}
+
+/// A timed stage of the pipeline; an index into `STAGE_NAMES`.
+#[derive(Copy, Clone)]
+enum Stage {
+    /// Requesting a recording, until its response headers arrive. The body downloads
+    /// concurrently with demuxing.
+    Fetch,
+    Demux,
+    Decode,
+
+    /// Comparing a selected frame to the last analyzed one.
+    Motion,
+
+    /// With `--detect-interval`, waiting for a recording's previous detections to decide
+    /// whether the next frame needs the detector.
+    DetectWait,
+    Scale,
+
+    /// Waiting for an idle interpreter.
+    TpuWait,
+
+    /// Filling an interpreter's input tensor.
+    Fill,
+    Invoke,
+    AppendFrame,
+    Zstd,
+
+    /// Inserting a batch of rows, including the commit.
+    Insert,
+
+    /// When following, the time from a recording's commit on the NVR until its results are
+    /// written. Not a span of this process's work, so it's absent from the trace.
+    LiveLatency,
+}
+
+const STAGE_NAMES: [&str; 13] = [
+    "fetch", "demux", "decode", "motion", "detect_wait", "scale", "tpu_wait", "fill", "invoke",
+    "append_frame", "zstd", "insert", "live_latency",
+];
+
+/// A sampled queue depth; an index into `GAUGE_NAMES`.
+#[derive(Copy, Clone)]
+enum Gauge {
+    /// Fetched recordings waiting for a decoder.
+    DecodeQueue,
+
+    /// Interpreters waiting for a decoder to fill them.
+    IdleInterpreters,
+
+    /// Filled interpreters waiting for an invoke thread.
+    FrameQueue,
+
+    /// Finished recordings waiting for the writer.
+    FinishedQueue,
 }
 
-struct Context<'a> {
-    conn: parking_lot::Mutex<rusqlite::Connection>,
+const GAUGE_NAMES: [&str; 4] = [
+    "decode_queue", "idle_interpreters", "frame_queue", "finished_queue",
+];
+
+const SAMPLE_INTERVAL: std::time::Duration = std::time::Duration::from_millis(100);
+
+/// When following, the longest to wait before retrying after consecutive failures to claim work
+/// or commit results.
+const MAX_RETRY_DELAY: std::time::Duration = std::time::Duration::from_secs(300);
+
+struct Context {
+    queue: Queue,
 
     // Stuff for fetching recordings.
     client: moonfire_nvr_client::Client,
@@ -47,14 +246,48 @@ struct Context<'a> {
     cameras: Option<Vec<String>>,
 
     // Stuff for processing recordings.
-    // This supports using multiple interpreters, one per Edge TPU device.
-    // Use a crossbeam channel as a crude object pool: receive one, use it, send it back.
-    interpreter_tx: crossbeam::channel::Sender<moonfire_tflite::Interpreter<'a>>,
-    interpreter_rx: crossbeam::channel::Receiver<moonfire_tflite::Interpreter<'a>>,
     width: usize,
     height: usize,
     min_interval_90k: i32,
+    frame_selection: FrameSelection,
+    motion_threshold: u8,
+    fetch_concurrency: usize,
     frames_processed: AtomicUsize,
+
+    /// Selected frames which reused the previous detections because nothing moved.
+    frames_skipped: AtomicUsize,
+
+    detect_interval: Option<u32>,
+
+    /// Analyzed frames whose boxes came from the tracker rather than the detector.
+    frames_tracked: AtomicUsize,
+
+    // Stuff for the shared work queue.
+    worker_id: String,
+    lease: std::time::Duration,
+    claim_batch: usize,
+
+    // Stuff for following new recordings.
+    follow: bool,
+    poll_interval: std::time::Duration,
+
+    /// The (approximate) commit time of each recording found by `poll_new` and not yet written,
+    /// keyed by `(stream_i, id)`, for measuring annotation latency.
+    live_commit_times: parking_lot::Mutex<std::collections::HashMap<(u32, i32), i64>>,
+
+    // Stuff for writing results.
+    commit_rows: usize,
+    commit_interval: std::time::Duration,
+    zstd_level: i32,
+
+    /// The id and contents of the `zstd_dictionary` to use, if any.
+    dictionary: Option<(i64, Vec<u8>)>,
+
+    metrics: Metrics,
+}
+
+impl Context {
+    fn record(&self, stage: Stage, start: Instant) { self.metrics.record(stage as usize, start) }
 }
 
 /// Gets the id range of committed recordings indicated by `r`.
@@ -63,30 +296,31 @@ fn id_range(r: &moonfire_nvr_client::Recording) -> std::ops::Range<i32> {
     r.start_id .. end_id
 }
 
-/// Removes values from sorted Vec `from` if they are also in sorted Iterator `remove`.
-/// Takes O(from.len() + remove.len()) time.
-fn filter_sorted<'a, T: 'a + Ord, I: Iterator<Item = &'a T>>(from: &mut Vec<T>, mut remove: I) {
-    let mut cur_remove = remove.next();
-    from.retain(|e| {
-        while let Some(r) = cur_remove.as_ref() {
-            match e.cmp(r) {
-                std::cmp::Ordering::Less => return true,
-                std::cmp::Ordering::Equal => return false,
-                std::cmp::Ordering::Greater => cur_remove = remove.next(),
+/// Orders the items of `lists` round-robin, returning each with the index of its list.
+///
+/// Used to spread concurrent fetches across streams, and thus across cameras and (usually) the
+/// NVR's sample file directories, rather than working through one stream at a time.
+fn interleave<T: Copy>(lists: &[&[T]]) -> Vec<(usize, T)> {
+    let mut out = Vec::with_capacity(lists.iter().map(|l| l.len()).sum());
+    let longest = lists.iter().map(|l| l.len()).max().unwrap_or(0);
+    for i in 0..longest {
+        for (list_i, l) in lists.iter().enumerate() {
+            if let Some(&e) = l.get(i) {
+                out.push((list_i, e));
             }
         }
-        true
-    });
+    }
+    out
 }
 
-async fn list_recordings(ctx: &Context<'_>) -> Result<Vec<Option<(Stream, Vec<i32>)>>, Error> {
+async fn list_recordings(ctx: &Context) -> Result<Vec<Option<(Stream, Vec<i32>)>>, Error> {
     let top_level = ctx.client.top_level(&moonfire_nvr_client::TopLevelRequest::default())
         .await?;
     Ok(futures::future::try_join_all(
         top_level.cameras.iter().map(|c| process_camera(&ctx, c))).await?)
 }
 
-async fn process_camera(ctx: &Context<'_>, camera: &moonfire_nvr_client::Camera)
+async fn process_camera(ctx: &Context, camera: &moonfire_nvr_client::Camera)
                         -> Result<Option<(Stream, Vec<i32>)>, Error> {
     const DESIRED_STREAM: &str = "sub";
     if let Some(cameras) = &ctx.cameras {
@@ -114,51 +348,98 @@ async fn process_camera(ctx: &Context<'_>, camera: &moonfire_nvr_client::Camera)
             ids.push(id);
         }
     }
-    if ids.is_empty() {
-        return Ok(None);
-    }
     ids.sort();  // it's probably sorted, but make sure.
-    let conn = ctx.conn.lock();
-    let mut stmt = conn.prepare_cached(r#"
-        select
-          recording_id
-        from
-          recording_object_detection
-        where
-          camera_uuid = ? and
-          stream_name = ? and
-          ? <= recording_id and
-          recording_id <= ?
-        order by recording_id
-    "#)?;
-    let u = camera.uuid.as_bytes();
-    let existing = stmt
-        .query_map(params![&u[..], DESIRED_STREAM, ids.first().unwrap(), ids.last().unwrap()],
-                   |row| row.get::<_, i32>(0))?
-        .collect::<Result<Vec<i32>, rusqlite::Error>>()?;
-    filter_sorted(&mut ids, existing.iter());
     let stream = Stream {
         camera_short_name: camera.short_name.clone(),
         camera_uuid: camera.uuid,
         stream_name: DESIRED_STREAM.to_owned(),
+        newest_id: ids.last().copied(),
     };
+    if ids.is_empty() {
+        // When following, keep watching the stream for new recordings.
+        return Ok(if ctx.follow { Some((stream, ids)) } else { None });
+    }
+    let ids = ctx.queue.enqueue(stream.key(), ids, BACKFILL_PRIORITY).await?;
     Ok(Some((stream, ids)))
 }
 
+/// Work queue priority for recordings found in the initial listing.
+const BACKFILL_PRIORITY: i32 = 0;
+
+/// Work queue priority for new recordings found while following; these are claimed first.
+const LIVE_PRIORITY: i32 = 1;
+
+/// Looks for recordings committed since the last poll, adding them to the work queue ahead of
+/// backfill work. Updates `newest_ids` (parallel to `streams`).
+async fn poll_new(ctx: &Context, streams: &[&Stream], newest_ids: &mut [Option<i32>])
+                  -> Result<(), Error> {
+    let now = now_90k();
+
+    // Look back far enough to cover the poll interval and any commit delay.
+    const LOOKBACK_90K: i64 = 10 * 60 * 90_000;
+    let listings = futures::future::try_join_all(streams.iter().map(|s| async move {
+        ctx.client.list_recordings(&moonfire_nvr_client::ListRecordingsRequest {
+            camera: s.camera_uuid,
+            stream: &s.stream_name,
+            start: Some(moonfire_nvr_client::Time(now - LOOKBACK_90K)),
+            end: None,
+        }).await
+    })).await?;
+    for (stream_i, (s, listing)) in streams.iter().zip(listings.iter()).enumerate() {
+        let newest = &mut newest_ids[stream_i];
+        let mut ids = Vec::new();
+        for r in &listing.recordings {
+            // id_range excludes the growing recording and anything else not yet committed.
+            let range = id_range(r);
+            for id in range.clone() {
+                if newest.map(|n| id > n).unwrap_or(true) {
+                    ids.push(id);
+
+                    // Each entry may cover several recordings; its end time is the (approximate)
+                    // commit time of the last. Recordings are committed in order shortly after
+                    // they end, so it's an upper bound for the rest, and their measured latency
+                    // is a lower bound.
+                    ctx.live_commit_times.lock()
+                       .insert((u32::try_from(stream_i).unwrap(), id), r.end_time_90k.0);
+                }
+            }
+        }
+        if ids.is_empty() {
+            continue;
+        }
+        ids.sort();
+        *newest = ids.last().copied();
+        info!("{}/{}: found {} new recordings", &s.camera_short_name, &s.stream_name, ids.len());
+        ctx.queue.enqueue(s.key(), ids, LIVE_PRIORITY).await?;
+    }
+    Ok(())
+}
+
 struct Stream {
     camera_short_name: String,
     camera_uuid: Uuid,
     stream_name: String,
+
+    /// The newest committed recording in the initial listing, if any.
+    newest_id: Option<i32>,
+}
+
+impl Stream {
+    fn key(&self) -> StreamKey<'_> {
+        StreamKey { camera_uuid: self.camera_uuid, stream_name: &self.stream_name }
+    }
 }
 
 struct Recording {
     stream_i: u32,
     id: i32,
-    body: bytes::Bytes,
+    body: StreamingBody,
 }
 
-async fn fetch_recording(ctx: &Context<'_>, stream: &Stream, id: i32)
-                         -> Result<bytes::Bytes, Error> {
+/// Starts fetching a recording, returning once the response headers have arrived.
+/// The body is streamed as it's decoded.
+async fn fetch_recording(ctx: &Context, stream: &Stream, id: i32)
+                         -> Result<StreamingBody, Error> {
     trace!("recording {}/{}/{}", &stream.camera_short_name, &stream.stream_name, id);
     let resp = ctx.client.view(&moonfire_nvr_client::ViewRequest {
         camera: stream.camera_uuid,
@@ -167,7 +448,137 @@ async fn fetch_recording(ctx: &Context<'_>, stream: &Stream, id: i32)
         s: &id.to_string(),
         ts: false,
     }).await?;
-    Ok(resp.bytes().await?)
+    StreamingBody::spawn(resp)
+}
+
+pub fn now_sec() -> i64 {
+    let now = std::time::SystemTime::now().duration_since(std::time::UNIX_EPOCH).unwrap();
+    i64::try_from(now.as_secs()).unwrap()
+}
+
+fn now_90k() -> i64 {
+    let now = std::time::SystemTime::now().duration_since(std::time::UNIX_EPOCH).unwrap();
+    i64::try_from(now.as_millis()).unwrap() * 90
+}
+
+/// Claims up to `batch` recordings of `streams` from the work queue, spread evenly across
+/// streams.
+async fn claim(ctx: &Context, streams: &[&Stream], batch: usize)
+               -> Result<Vec<(usize, i32)>, Error> {
+    if streams.is_empty() {
+        return Ok(Vec::new());
+    }
+    let keys: Vec<_> = streams.iter().map(|s| s.key()).collect();
+    let per_stream = std::cmp::max(1, batch / streams.len());
+    let claimed = ctx.queue.claim(&ctx.worker_id, ctx.lease, &keys, per_stream).await?;
+    let lists: Vec<&[i32]> = claimed.iter().map(|c| &c[..]).collect();
+    Ok(interleave(&lists))
+}
+
+/// Returns a claimed recording to the work queue, so it can be claimed again.
+fn release(ctx: &Context, stream: &Stream, id: i32) -> Result<(), Error> {
+    futures::executor::block_on(ctx.queue.release(&ctx.worker_id, stream.key(), id))
+}
+
+/// Renews leases every third of the lease duration until `stop_rx` is disconnected.
+fn run_lease_renewer(ctx: &Context, stop_rx: crossbeam::channel::Receiver<()>) {
+    while let Err(RecvTimeoutError::Timeout) = stop_rx.recv_timeout(ctx.lease / 3) {
+        match futures::executor::block_on(ctx.queue.renew(&ctx.worker_id, ctx.lease)) {
+            Ok(n) => debug!("renewed {} leases", n),
+            Err(e) => warn!("unable to renew leases: {}", e),
+        }
+    }
+}
+
+/// Claims and fetches work in batches, with up to `ctx.fetch_concurrency` requests in flight,
+/// sending recordings to the decoders via `decode_tx`. Returns the total time spent blocked on
+/// `decode_tx`.
+///
+/// When the decoders fall behind, the blocking send also stops further fetches from starting.
+/// When there's nothing left to claim but other processes still hold leases, waits in case
+/// they die and their work needs to be reclaimed.
+///
+/// When following, this never returns; it polls for new recordings between batches and claims
+/// small batches so new recordings don't wait long behind backfill work. Errors fetching a
+/// recording return it to the queue; errors claiming are retried after `retry_delay`, which
+/// doubles with each consecutive failure up to `MAX_RETRY_DELAY`.
+async fn fetch_all(ctx: &Context, streams: &[&Stream],
+                   decode_tx: crossbeam::channel::Sender<Recording>)
+                   -> Result<std::time::Duration, Error> {
+    let mut send_time = std::time::Duration::new(0, 0);
+    let mut newest_ids: Vec<Option<i32>> = streams.iter().map(|s| s.newest_id).collect();
+    let mut last_poll: Option<Instant> = None;
+    let batch_size = if ctx.follow { ctx.fetch_concurrency } else { ctx.claim_batch };
+    let mut retry_delay = ctx.poll_interval;
+    loop {
+        if ctx.follow && last_poll.map(|p| p.elapsed() >= ctx.poll_interval).unwrap_or(true) {
+            last_poll = Some(Instant::now());
+            if let Err(e) = poll_new(ctx, streams, &mut newest_ids).await {
+                warn!("unable to poll for new recordings: {}", e);
+            }
+        }
+        let batch = match claim(ctx, streams, batch_size).await {
+            Ok(b) => {
+                retry_delay = ctx.poll_interval;
+                b
+            },
+            Err(e) if ctx.follow => {
+                warn!("unable to claim work: {}; retrying in {:?}", e, retry_delay);
+                tokio::time::sleep(retry_delay).await;
+                retry_delay = std::cmp::min(retry_delay * 2, MAX_RETRY_DELAY);
+                continue;
+            },
+            Err(e) => return Err(e),
+        };
+        if batch.is_empty() {
+            if ctx.follow {
+                tokio::time::sleep(ctx.poll_interval).await;
+                continue;
+            }
+            let keys: Vec<_> = streams.iter().map(|s| s.key()).collect();
+            let others = ctx.queue.leased_by_others(&ctx.worker_id, &keys).await?;
+            if others == 0 {
+                return Ok(send_time);
+            }
+            debug!("waiting for {} recordings leased by other processes", others);
+            tokio::time::sleep(ctx.lease / 2).await;
+            continue;
+        }
+        let mut fetches = futures::stream::iter(batch)
+            .map(|(stream_i, id)| async move {
+                let start = Instant::now();
+                let body = fetch_recording(ctx, streams[stream_i], id).await;
+                if body.is_ok() {
+                    ctx.record(Stage::Fetch, start);
+                }
+                (stream_i, id, body)
+            })
+            .buffer_unordered(ctx.fetch_concurrency);
+        while let Some((stream_i, id, body)) = fetches.next().await {
+            let body = match body {
+                Ok(b) => b,
+                Err(e) if ctx.follow => {
+                    // Let this or another process try again later.
+                    let s = streams[stream_i];
+                    warn!("{}/{} recording {}: unable to fetch: {}; returning it to the queue",
+                          &s.camera_short_name, &s.stream_name, id, e);
+                    if let Err(e) = ctx.queue.release(&ctx.worker_id, s.key(), id).await {
+                        warn!("unable to return {}/{} recording {} to the queue: {}",
+                              &s.camera_short_name, &s.stream_name, id, e);
+                    }
+                    continue;
+                },
+                Err(e) => return Err(e),
+            };
+            let before = Instant::now();
+            decode_tx.send(Recording {
+                stream_i: u32::try_from(stream_i).unwrap(),
+                id,
+                body,
+            }).unwrap();
+            send_time += before.elapsed();
+        }
+    }
 }
 
 pub fn zigzag32(i: i32) -> u32 { ((i << 1) as u32) ^ ((i >> 31) as u32) }
@@ -198,6 +609,12 @@ pub fn append_varint32(i: u32, data: &mut Vec<u8>) {
 
 const SCORE_THRESHOLD: f32 = 0.5;
 
+/// The minimum intersection over union for a detection to continue a track.
+const TRACK_MIN_IOU: f32 = 0.3;
+
+/// The number of detector runs a track can go unmatched before it's dropped.
+const TRACK_MAX_MISSES: u32 = 2;
+
 fn normalize(v: f32) -> u8 {
     (v.max(0.).min(1.0) * 255.) as u8
 }
@@ -227,13 +644,194 @@ pub fn append_frame(interpreter: &moonfire_tflite::Interpreter<'_>, data: &mut V
     }
 }
 
-fn process_recording(ctx: &Context<'_>, streams: &Vec<&Stream>, recording: &Recording)
-                     -> Result<(), Error> {
+/// Appends `objs` in the same encoding as `append_frame`.
+fn append_objects(objs: &[Object<'_>], data: &mut Vec<u8>) {
+    append_varint32(u32::try_from(objs.len()).unwrap(), data);
+    for o in objs {
+        let class = nvr_analytics::LABELS.iter().position(|&l| l == Some(o.label))
+            .expect("objects have labels from LABELS");
+        append_varint32(u32::try_from(class).unwrap(), data);
+        data.extend_from_slice(&[normalize(o.x), normalize(o.w), normalize(o.y), normalize(o.h),
+                                 normalize(o.score)]);
+    }
+}
+
+fn read_varint32(data: &mut &[u8]) -> Result<u32, Error> {
+    let mut v = 0;
+    for shift in (0..35).step_by(7) {
+        let (&b, rest) = data.split_first().ok_or_else(|| format_err!("truncated varint"))?;
+        *data = rest;
+        v |= u32::from(b & 0x7F) << shift;
+        if b & 0x80 == 0 {
+            return Ok(v);
+        }
+    }
+    bail!("varint too long")
+}
+
+/// Parses a frame encoded by `append_frame` into `objs`, skipping any without a label.
+fn parse_frame(mut data: &[u8], objs: &mut Vec<Object<'static>>) -> Result<(), Error> {
+    let n = read_varint32(&mut data)?;
+    for _ in 0..n {
+        let class = read_varint32(&mut data)?;
+        if data.len() < 5 {
+            bail!("truncated object");
+        }
+        let (b, rest) = data.split_at(5);
+        data = rest;
+        let f = |v: u8| f32::from(v) / 255.;
+        if let Some(label) = nvr_analytics::label(class as f32) {
+            objs.push(Object {
+                label,
+                x: f(b[0]),
+                w: f(b[1]),
+                y: f(b[2]),
+                h: f(b[3]),
+                score: f(b[4]),
+                track: None,
+            });
+        }
+    }
+    Ok(())
+}
+
+type Interpreter<'a> = moonfire_tflite::Interpreter<'a>;
+
+/// An interpreter whose input tensor has been filled with a frame, on its way from a decoder
+/// worker to an invoke thread.
+struct Frame<'a> {
+    interpreter: Interpreter<'a>,
+    recording: Arc<InFlight>,
+
+    /// The index of this frame within the recording's analyzed frames.
+    seq: usize,
+}
+
+/// A recording with frames in the decode or inference stages.
+struct InFlight {
+    stream_i: u32,
+    id: i32,
+    state: parking_lot::Mutex<InFlightState>,
+
+    /// Signaled as each frame is completed, for `wait_frame`.
+    completed: parking_lot::Condvar,
+}
+
+#[derive(Default)]
+struct InFlightState {
+    /// Each analyzed frame's detections (or tracked objects), as encoded by `append_frame`, in
+    /// order. `None` until the interpreter thread handling it completes, or for a frame in
+    /// `repeats`.
+    frames: Vec<Option<Vec<u8>>>,
+
+    /// Indices of frames which reuse the detections of the frame before, in ascending order.
+    repeats: Vec<usize>,
+
+    /// The number of frames still awaiting an interpreter: `None` entries in `frames` which
+    /// aren't in `repeats`.
+    outstanding: usize,
+
+    /// The encoded durations, set when the decoder has sent the final frame.
+    durations: Option<Vec<u8>>,
+}
+
+/// A recording which has been entirely analyzed, ready to compress and write.
+struct Finished {
+    stream_i: u32,
+    id: i32,
+    frames: Vec<Vec<u8>>,
+    durations: Vec<u8>,
+}
+
+impl InFlight {
+    fn new(stream_i: u32, id: i32) -> Self {
+        InFlight {
+            stream_i,
+            id,
+            state: parking_lot::Mutex::new(InFlightState::default()),
+            completed: parking_lot::Condvar::new(),
+        }
+    }
+
+    /// Reserves a slot for the next analyzed frame, returning its sequence number.
+    fn add_frame(&self) -> usize {
+        let mut l = self.state.lock();
+        l.frames.push(None);
+        l.outstanding += 1;
+        l.frames.len() - 1
+    }
+
+    /// Adds a frame whose encoded objects are already known, as from the tracker.
+    fn add_known_frame(&self, data: Vec<u8>) {
+        self.state.lock().frames.push(Some(data));
+    }
+
+    /// Waits for frame `seq` (from `add_frame`) to be completed, returning its detections.
+    /// Must be called before `finish_decoding`.
+    fn wait_frame(&self, seq: usize) -> Vec<u8> {
+        let mut l = self.state.lock();
+        loop {
+            if let Some(d) = l.frames[seq].as_ref() {
+                return d.clone();
+            }
+            self.completed.wait(&mut l);
+        }
+    }
+
+    /// Adds a frame which reuses the previous frame's detections.
+    fn repeat_frame(&self) {
+        let mut l = self.state.lock();
+        assert!(!l.frames.is_empty());
+        l.frames.push(None);
+        let seq = l.frames.len() - 1;
+        l.repeats.push(seq);
+    }
+
+    /// Records the detections for frame `seq`, returning the recording if it's now finished.
+    fn complete_frame(&self, seq: usize, data: Vec<u8>) -> Option<Finished> {
+        let mut l = self.state.lock();
+        let slot = &mut l.frames[seq];
+        assert!(slot.is_none());
+        *slot = Some(data);
+        l.outstanding -= 1;
+        self.completed.notify_all();
+        self.take_if_finished(&mut l)
+    }
+
+    /// Notes that decoding is done, returning the recording if it's now finished.
+    fn finish_decoding(&self, durations: Vec<u8>) -> Option<Finished> {
+        let mut l = self.state.lock();
+        l.durations = Some(durations);
+        self.take_if_finished(&mut l)
+    }
+
+    fn take_if_finished(&self, l: &mut InFlightState) -> Option<Finished> {
+        if l.outstanding > 0 || l.durations.is_none() {
+            return None;
+        }
+        for &i in &std::mem::take(&mut l.repeats) {
+            l.frames[i] = l.frames[i - 1].clone();
+        }
+        Some(Finished {
+            stream_i: self.stream_i,
+            id: self.id,
+            frames: std::mem::take(&mut l.frames).into_iter().map(Option::unwrap).collect(),
+            durations: l.durations.take().unwrap(),
+        })
+    }
+}
+
+/// Decodes `recording` and sends its selected frames, scaled, to `frame_tx`.
+/// The decoder stage of the pipeline.
+fn decode_recording<'a>(ctx: &Context, recording: Recording,
+                        idle_rx: &crossbeam::channel::Receiver<Interpreter<'a>>,
+                        frame_tx: &crossbeam::channel::Sender<Frame<'a>>,
+                        finished_tx: &crossbeam::channel::Sender<Finished>) -> Result<(), Error> {
     let mut open_options = moonfire_ffmpeg::avutil::Dictionary::new();
-    let mut io_ctx = moonfire_ffmpeg::avformat::SliceIoContext::new(&recording.body);
-    let mut input = moonfire_ffmpeg::avformat::InputFormatContext::with_io_context(
-        cstr!(""), &mut io_ctx, &mut open_options).unwrap();
-    input.find_stream_info().unwrap();
+    let mut input = moonfire_ffmpeg::avformat::InputFormatContext::open(
+        &recording.body.url(), &mut open_options)
+        .map_err(|e| format_err!("unable to open: {}", e))?;
+    input.find_stream_info().map_err(|e| format_err!("unable to find stream info: {}", e))?;
 
     // In .mp4 files generated by Moonfire NVR, the video is always stream 0.
     // The timestamp subtitles (if any) are stream 1.
@@ -243,7 +841,12 @@ fn process_recording(ctx: &Context<'_>, streams: &Vec<&Stream>, recording: &Reco
     let par = stream.codecpar();
     let mut dopt = moonfire_ffmpeg::avutil::Dictionary::new();
     dopt.set(cstr!("refcounted_frames"), cstr!("0")).unwrap();  // TODO?
-    let d = par.new_decoder(&mut dopt).unwrap();
+    if ctx.frame_selection == FrameSelection::Fast {
+        // Nothing references these frames, so they can be dropped without affecting the others.
+        // Keyframes are always reference frames, so this is also fine when feeding only those.
+        dopt.set(cstr!("skip_frame"), cstr!("noref")).unwrap();
+    }
+    let d = par.new_decoder(&mut dopt).map_err(|e| format_err!("unable to decode: {}", e))?;
 
     let mut scaled = VideoFrame::owned(moonfire_ffmpeg::avutil::ImageDimensions {
         width: i32::try_from(ctx.width).unwrap(),
@@ -253,27 +856,66 @@ fn process_recording(ctx: &Context<'_>, streams: &Vec<&Stream>, recording: &Reco
     let mut f = VideoFrame::empty().unwrap();
     let mut s = moonfire_ffmpeg::swscale::Scaler::new(par.dims(), scaled.dims()).unwrap();
 
-    let mut frame_data = Vec::with_capacity(4096);
+    let in_flight = Arc::new(InFlight::new(recording.stream_i, recording.id));
+    let mut gate = nvr_analytics::motion::Gate::new(ctx.motion_threshold);
     let mut durations = Vec::with_capacity(4096);
     let mut last_duration = 0;
     let mut next_pts = 0;
-    append_varint32(u32::try_from(ctx.min_interval_90k).unwrap(), &mut frame_data);
+
+    // For FrameSelection::Fast: the pts of the last keyframe and the longest GOP seen so far.
+    let mut last_key_pts = None;
+    let mut max_gop_90k = None;
+
+    // With --detect-interval: the tracker, the sequence number of the last frame sent to the
+    // detector if its detections haven't been fed to the tracker yet, and the number of
+    // analyzed frames since the detector last ran (`None` before it has).
+    let mut tracker = ctx.detect_interval.map(|_| Tracker::new(TRACK_MIN_IOU, TRACK_MAX_MISSES));
+    let mut pending = None;
+    let mut since_detect: Option<u32> = None;
+    let mut detections = Vec::new();
+    let mut objs = Vec::new();
     loop {
+        let start = Instant::now();
         let pkt = match input.read_frame() {
             Ok(p) => p,
             Err(e) if e.is_eof() => { break; },
-            Err(e) => panic!("{}", e),
+            Err(e) => bail!("unable to read: {}", e),
         };
+        ctx.record(Stage::Demux, start);
         if pkt.stream_index() != VIDEO_STREAM {
             continue;
         }
-        if !d.decode_video(&pkt, &mut f).unwrap() {
+
+        // Record every packet's duration, whether it's decoded or not.
+        let duration = pkt.duration();
+        append_varint32(zigzag32(duration.checked_sub(last_duration).unwrap()), &mut durations);
+        last_duration = duration;
+        let pts = pkt.pts().unwrap();
+
+        if ctx.frame_selection == FrameSelection::Fast {
+            let is_key = pkt.is_key();
+            if is_key {
+                if let Some(l) = last_key_pts {
+                    max_gop_90k = Some(std::cmp::max(max_gop_90k.unwrap_or(0), pts - l));
+                }
+                last_key_pts = Some(pts);
+            }
+            let keyframes_only = match max_gop_90k {
+                Some(g) => i64::from(ctx.min_interval_90k) >= g,
+                None => false,
+            };
+            if keyframes_only && (!is_key || pts < next_pts) {
+                continue;
+            }
+        }
+
+        let start = Instant::now();
+        let decoded = d.decode_video(&pkt, &mut f)
+            .map_err(|e| format_err!("unable to decode: {}", e))?;
+        ctx.record(Stage::Decode, start);
+        if !decoded {
             continue;
         }
-        let d = pkt.duration();
-        append_varint32(zigzag32(d.checked_sub(last_duration).unwrap()), &mut durations);
-        last_duration = d;
-        let pts = pkt.pts().unwrap();
         match pts.cmp(&next_pts) {
             std::cmp::Ordering::Less => continue,
             std::cmp::Ordering::Equal => {},
@@ -288,35 +930,289 @@ fn process_recording(ctx: &Context<'_>, streams: &Vec<&Stream>, recording: &Reco
             },
         }
 
-        // Perform object detection on the frame.
+        let start = Instant::now();
+        let changed = gate.changed(&f);
+        ctx.record(Stage::Motion, start);
+        if !changed {
+            in_flight.repeat_frame();
+            ctx.frames_skipped.fetch_add(1, Ordering::Relaxed);
+            continue;
+        }
+
+        // Like webvtt_standalone, the tracker advances only on analyzed frames.
+        if let Some(t) = tracker.as_mut() {
+            if let Some(seq) = pending.take() {
+                let start = Instant::now();
+                let d = in_flight.wait_frame(seq);
+                ctx.record(Stage::DetectWait, start);
+                detections.clear();
+                parse_frame(&d, &mut detections)?;
+                t.update(&detections);
+            }
+            let due = match since_detect {
+                None => true,
+                Some(n) => {
+                    t.predict();
+                    n + 1 >= ctx.detect_interval.unwrap() || t.uncertain()
+                },
+            };
+            if !due {
+                since_detect = since_detect.map(|n| n + 1);
+                objs.clear();
+                t.objects(&mut objs);
+                let mut data = Vec::with_capacity(64);
+                append_objects(&objs, &mut data);
+                in_flight.add_known_frame(data);
+                ctx.frames_tracked.fetch_add(1, Ordering::Relaxed);
+                continue;
+            }
+            since_detect = Some(0);
+        }
+
+        // Scale the frame straight into an idle interpreter's input and hand it off for object
+        // detection.
+        let start = Instant::now();
         s.scale(&f, &mut scaled);
-        let mut interpreter = ctx.interpreter_rx.recv().unwrap();
+        ctx.record(Stage::Scale, start);
+        let start = Instant::now();
+        let mut interpreter = idle_rx.recv().unwrap();
+        ctx.record(Stage::TpuWait, start);
+        let start = Instant::now();
         nvr_analytics::copy(&scaled, &mut interpreter.inputs()[0]);
+        ctx.record(Stage::Fill, start);
+        let seq = in_flight.add_frame();
+        if tracker.is_some() {
+            pending = Some(seq);
+        }
+        frame_tx.send(Frame {
+            interpreter,
+            recording: in_flight.clone(),
+            seq,
+        }).unwrap();
+    }
+    drop(input);
+
+    // Don't record results for a truncated download.
+    recording.body.finish()?;
+    if let Some(f) = in_flight.finish_decoding(durations) {
+        finished_tx.send(f).unwrap();
+    }
+    Ok(())
+}
+
+/// Runs object detection on frames from `frame_rx` until all decoders are done.
+/// The inference stage of the pipeline.
+fn run_invoker<'a>(ctx: &Context, frame_rx: crossbeam::channel::Receiver<Frame<'a>>,
+                   idle_tx: crossbeam::channel::Sender<Interpreter<'a>>,
+                   finished_tx: crossbeam::channel::Sender<Finished>) {
+    for frame in frame_rx.iter() {
+        let mut interpreter = frame.interpreter;
+        let start = Instant::now();
         interpreter.invoke().unwrap();
+        ctx.record(Stage::Invoke, start);
         ctx.frames_processed.fetch_add(1, Ordering::Relaxed);
-        append_frame(&interpreter, &mut frame_data);
-        ctx.interpreter_tx.try_send(interpreter).unwrap();
-    }
-    let compressed = zstd::stream::encode_all(&frame_data[..], 22)?;
-
-    let conn = ctx.conn.lock();
-    let mut stmt = conn.prepare_cached(r#"
-        insert into recording_object_detection (camera_uuid, stream_name, recording_id, frame_data,
-                                                durations)
-            values (?, ?, ?, ?, ?)
-    "#)?;
-    let stream = streams[usize::try_from(recording.stream_i).unwrap()];
-    let u = stream.camera_uuid.as_bytes();
-    stmt.execute(params![&u[..], &stream.stream_name, &recording.id, &compressed, &durations])?;
+        let start = Instant::now();
+        let mut data = Vec::with_capacity(64);
+        append_frame(&interpreter, &mut data);
+        ctx.record(Stage::AppendFrame, start);
+        idle_tx.send(interpreter).unwrap();
+        if let Some(f) = frame.recording.complete_frame(frame.seq, data) {
+            finished_tx.send(f).unwrap();
+        }
+    }
+}
+
+/// Samples the depth of each queue between stages until `stop_rx` is disconnected.
+fn run_sampler<'a>(ctx: &Context, decode_rx: &crossbeam::channel::Receiver<Recording>,
+                   idle_rx: &crossbeam::channel::Receiver<Interpreter<'a>>,
+                   frame_rx: &crossbeam::channel::Receiver<Frame<'a>>,
+                   finished_rx: &crossbeam::channel::Receiver<Finished>,
+                   stop_rx: crossbeam::channel::Receiver<()>) {
+    while let Err(RecvTimeoutError::Timeout) = stop_rx.recv_timeout(SAMPLE_INTERVAL) {
+        ctx.metrics.sample(Gauge::DecodeQueue as usize, decode_rx.len());
+        ctx.metrics.sample(Gauge::IdleInterpreters as usize, idle_rx.len());
+        ctx.metrics.sample(Gauge::FrameQueue as usize, frame_rx.len());
+        ctx.metrics.sample(Gauge::FinishedQueue as usize, finished_rx.len());
+    }
+}
+
+/// A compressed recording, ready to insert.
+struct Row {
+    stream_i: u32,
+    analyzed: Analyzed,
+}
+
+fn compress(ctx: &Context, dict: Option<&zstd::dict::EncoderDictionary<'_>>, recording: Finished)
+            -> Result<Row, Error> {
+    let mut frame_data = Vec::with_capacity(
+        5 + recording.frames.iter().map(|f| f.len()).sum::<usize>());
+    append_varint32(u32::try_from(ctx.min_interval_90k).unwrap(), &mut frame_data);
+    for f in &recording.frames {
+        frame_data.extend_from_slice(f);
+    }
+    let start = Instant::now();
+    let frame_data = nvr_analytics::dictionary::compress(&frame_data[..], ctx.zstd_level, dict)?;
+    ctx.record(Stage::Zstd, start);
+    Ok(Row {
+        stream_i: recording.stream_i,
+        analyzed: Analyzed {
+            recording_id: recording.id,
+            frame_data,
+            frame_data_dictionary_id: ctx.dictionary.as_ref().map(|&(id, _)| id),
+            durations: recording.durations,
+        },
+    })
+}
+
+/// Statistics on the writer's transactions.
+#[derive(Default)]
+struct CommitStats {
+    commits: usize,
+    rows: usize,
+    max_batch: usize,
+    total_latency: std::time::Duration,
+    max_latency: std::time::Duration,
+}
+
+/// Inserts `batch` in a single transaction, then clears it.
+fn commit(ctx: &Context, streams: &[&Stream], batch: &mut Vec<Row>, stats: &mut CommitStats)
+          -> Result<(), Error> {
+    if batch.is_empty() {
+        return Ok(());
+    }
+    let before = Instant::now();
+    let recordings: Vec<_> = batch.iter().map(|row| {
+        (streams[usize::try_from(row.stream_i).unwrap()].key(), &row.analyzed)
+    }).collect();
+    futures::executor::block_on(ctx.queue.complete(&recordings))?;
+    let latency = before.elapsed();
+    ctx.record(Stage::Insert, before);
+
+    // Note how long after commit any followed recordings were written.
+    if ctx.follow {
+        let now = now_90k();
+        let mut live_commit_times = ctx.live_commit_times.lock();
+        for row in batch.iter() {
+            let id = row.analyzed.recording_id;
+            if let Some(committed) = live_commit_times.remove(&(row.stream_i, id)) {
+                let stream = streams[usize::try_from(row.stream_i).unwrap()];
+                let live_latency_90k = u64::try_from(std::cmp::max(now - committed, 0)).unwrap();
+                let live_latency = std::time::Duration::from_micros(live_latency_90k * 100 / 9);
+                info!("{}/{}/{}: annotated {:.1?} after commit", &stream.camera_short_name,
+                      &stream.stream_name, id, live_latency);
+                ctx.metrics.record_duration(Stage::LiveLatency as usize, live_latency);
+            }
+        }
+    }
+
+    debug!("committed {} rows in {:?}", batch.len(), latency);
+    stats.commits += 1;
+    stats.rows += batch.len();
+    stats.max_batch = std::cmp::max(stats.max_batch, batch.len());
+    stats.total_latency += latency;
+    stats.max_latency = std::cmp::max(stats.max_latency, latency);
+    batch.clear();
     Ok(())
 }
 
+/// Compresses and writes finished recordings from `finished_rx` until all workers are done.
+/// The final stage of the pipeline.
+///
+/// Rows are grouped into transactions, committed when `ctx.commit_rows` are pending or the oldest
+/// has waited `ctx.commit_interval`. This amortizes the fsync over many recordings. When
+/// following, a failed commit is retried until it succeeds.
+fn run_writer(ctx: &Context, streams: &[&Stream],
+              finished_rx: crossbeam::channel::Receiver<Finished>,
+              mut on_commit: impl FnMut(usize)) -> Result<CommitStats, Error> {
+    let mut stats = CommitStats::default();
+    let mut batch = Vec::with_capacity(ctx.commit_rows);
+    let dict = ctx.dictionary.as_ref()
+        .map(|(_, d)| zstd::dict::EncoderDictionary::copy(d, ctx.zstd_level));
+    let mut deadline = None;
+    loop {
+        let r = match deadline {
+            None => finished_rx.recv().map_err(|_| RecvTimeoutError::Disconnected),
+            Some(d) => finished_rx.recv_timeout(d - std::cmp::min(d, Instant::now())),
+        };
+        let done = match r {
+            Ok(f) => {
+                batch.push(compress(ctx, dict.as_ref(), f)?);
+                if deadline.is_none() {
+                    deadline = Some(Instant::now() + ctx.commit_interval);
+                }
+                if batch.len() < ctx.commit_rows {
+                    continue;
+                }
+                false
+            },
+            Err(RecvTimeoutError::Timeout) => false,
+            Err(RecvTimeoutError::Disconnected) => true,
+        };
+        let n = batch.len();
+        let mut retry_delay = ctx.poll_interval;
+        while let Err(e) = commit(ctx, streams, &mut batch, &mut stats) {
+            if !ctx.follow {
+                return Err(e);
+            }
+            warn!("unable to commit {} rows: {}; retrying in {:?}", n, e, retry_delay);
+            std::thread::sleep(retry_delay);
+            retry_delay = std::cmp::min(retry_delay * 2, MAX_RETRY_DELAY);
+        }
+        on_commit(n);
+        deadline = None;
+        if done {
+            return Ok(stats);
+        }
+    }
+}
+
 fn main() -> Result<(), Error> {
     let mut h = nvr_analytics::init_logging();
     let _a = h.async_scope();
     let opt = Opt::from_args();
 
-    let conn = parking_lot::Mutex::new(rusqlite::Connection::open(&opt.db)?);
+    let rt = tokio::runtime::Runtime::new()?;
+    let queue = match (opt.db.as_ref(), opt.coordinator.clone()) {
+        (Some(db), None) => {
+            let conn = nvr_analytics::db::open(db)?;
+
+            // WAL mode lets a commit be a single sequential append and fsync.
+            let journal_mode: String = conn.query_row("pragma journal_mode = wal",
+                                                      rusqlite::params![], |row| row.get(0))?;
+            if journal_mode != "wal" {
+                warn!("unable to use WAL mode; journal_mode is {}", journal_mode);
+            }
+            conn.execute_batch("pragma synchronous = normal")?;
+            let conn = Arc::new(parking_lot::Mutex::new(conn));
+            if let Some(addr) = opt.listen {
+                let service = nvr_analytics::work_queue::service(conn.clone());
+                info!("Serving the work queue on {}", addr);
+                rt.spawn(async move {
+                    if let Err(e) = tonic::transport::Server::builder()
+                        .add_service(service)
+                        .serve(addr)
+                        .await {
+                        error!("unable to serve the work queue on {}: {}", addr, e);
+                    }
+                });
+            }
+            Queue::Local(conn)
+        },
+        (None, Some(url)) if opt.listen.is_none() => {
+            info!("Using the work queue at {}", &url);
+            rt.block_on(nvr_analytics::work_queue::connect(url))?
+        },
+        _ => bail!("expected either --db (optionally with --listen) or --coordinator"),
+    };
+
+    let dictionary = match (opt.no_zstd_dictionary, opt.zstd_dictionary) {
+        (true, _) => None,
+        (false, id) => rt.block_on(queue.dictionary(id))?,
+    };
+    match dictionary.as_ref() {
+        None => info!("Compressing without a dictionary"),
+        Some((id, d)) => info!("Compressing with dictionary {} ({} bytes)", id, d.len()),
+    }
 
     info!("Loading model");
     let m = moonfire_tflite::Model::from_static(nvr_analytics::MODEL).unwrap();
@@ -330,7 +1226,11 @@ fn main() -> Result<(), Error> {
         .map(|d| d.create_delegate())
         .collect::<Result<Vec<_>, ()>>()
         .map_err(|()| format_err!("Unable to create delegate"))?;
-    let mut interpreters = delegates.iter().map(|d| {
+    // Two interpreters per device, so a decoder can fill one's input while the other invokes.
+    const INTERPRETERS_PER_DEVICE: usize = 2;
+    let interpreters = delegates.iter().flat_map(|d| {
+        std::iter::repeat(d).take(INTERPRETERS_PER_DEVICE)
+    }).map(|d| {
         let mut builder = moonfire_tflite::Interpreter::builder();
         builder.add_borrowed_delegate(d);
         builder.build(&m)
@@ -349,35 +1249,58 @@ fn main() -> Result<(), Error> {
         assert_eq!(input.dim(3), 3);
     }
 
-    // Fill the interpreter "pool" (channel).
-    let (interpreter_tx, interpreter_rx) = crossbeam::channel::bounded(interpreters.len());
-    for i in interpreters.into_iter() {
-        interpreter_tx.try_send(i).unwrap();
-    }
-
     let min_interval_90k = match opt.fps {
         None => 1,
         Some(f) if f > 0. => (90000. / f) as i32,
         Some(_) => panic!("interval fps; must be non-negative"),
     };
     assert!(min_interval_90k > 0);
+    if opt.detect_interval == Some(0) {
+        bail!("--detect-interval must be positive");
+    }
+
+    // The start time keeps a later process which reuses this pid from inheriting its leases.
+    let worker_id = match opt.worker_id {
+        Some(w) => w,
+        None => {
+            let host = std::fs::read_to_string("/proc/sys/kernel/hostname")
+                .map(|h| h.trim().to_owned())
+                .unwrap_or_default();
+            format!("{}:{}@{}", host, std::process::id(), now_sec())
+        },
+    };
+    info!("Worker id is {:?}", &worker_id);
 
     let ctx = Context {
         client: moonfire_nvr_client::Client::new(opt.nvr, opt.cookie),
-        conn,
-        interpreter_tx,
-        interpreter_rx,
+        queue,
         width,
         height,
         start: opt.start,
         end: opt.end,
         cameras: opt.cameras,
         min_interval_90k,
+        frame_selection: opt.frame_selection,
+        motion_threshold: opt.motion_threshold,
+        fetch_concurrency: opt.fetch_concurrency,
         frames_processed: AtomicUsize::new(0),
+        frames_skipped: AtomicUsize::new(0),
+        detect_interval: opt.detect_interval,
+        frames_tracked: AtomicUsize::new(0),
+        worker_id,
+        lease: std::time::Duration::from_secs(std::cmp::max(opt.lease_secs, 3)),
+        claim_batch: std::cmp::max(opt.claim_batch, 1),
+        follow: opt.follow,
+        poll_interval: std::time::Duration::from_secs(std::cmp::max(opt.poll_secs, 1)),
+        live_commit_times: parking_lot::Mutex::new(std::collections::HashMap::new()),
+        commit_rows: std::cmp::max(opt.commit_rows, 1),
+        commit_interval: std::time::Duration::from_millis(opt.commit_interval_ms),
+        zstd_level: opt.zstd_level,
+        dictionary,
+        metrics: Metrics::new(&STAGE_NAMES, &GAUGE_NAMES, opt.trace_file.is_some()),
     };
 
     let _ffmpeg = moonfire_ffmpeg::Ffmpeg::new();
-    let rt = tokio::runtime::Runtime::new()?;
 
     info!("Finding recordings");
     let stuff = rt.block_on(list_recordings(&ctx))?;
@@ -397,66 +1320,163 @@ fn main() -> Result<(), Error> {
             .progress_chars("##-")));
     progress.enable_steady_tick(100);
 
-    let (decode_tx, decode_rx) = crossbeam::channel::bounded(16);
+    // Each queued recording holds an open connection whose download is stalled until a decoder
+    // gets to it, so keep this short.
+    let (decode_tx, decode_rx) = crossbeam::channel::bounded(rayon::current_num_threads());
     let mut decode_tx = Some(decode_tx);
 
-    let start = std::time::Instant::now();
-    rayon::scope(|s| {
-        // Decoder threads.
-        s.spawn(|_| {
-            let before = std::time::Instant::now();
-            info!("Decoder thread starting");
-            decode_rx.iter().par_bridge().try_for_each(|r: Recording| -> Result<(), Error> {
-                process_recording(&ctx, &streams, &r)?;
-                let frames_processed = ctx.frames_processed.load(Ordering::Relaxed);
-                let elapsed = std::time::Instant::now() - start;
-                info!("rate = {:.1} fps", frames_processed as f32 / elapsed.as_secs_f32());
-                progress.inc(1);
-                Ok(())
+    // Fill the interpreter "pool" (channel). Filled interpreters go to `frame_tx`; the invoke
+    // threads send them back here.
+    let num_interpreters = interpreters.len();
+    let (idle_tx, idle_rx) = crossbeam::channel::bounded(num_interpreters);
+    for i in interpreters.into_iter() {
+        idle_tx.try_send(i).unwrap();
+    }
+    let (frame_tx, frame_rx) = crossbeam::channel::bounded(num_interpreters);
+    let mut frame_tx = Some(frame_tx);
+
+    let (finished_tx, finished_rx) = crossbeam::channel::bounded(16);
+    let mut finished_tx = Some(finished_tx);
+
+    let mut fetch_result = Ok(());
+    let start = Instant::now();
+    crossbeam::scope(|cs| {
+        // Invoke threads. These spend most of their time blocked on the Edge TPU, so they get
+        // dedicated threads rather than occupying the rayon pool.
+        for i in 0..num_interpreters {
+            let (ctx, frame_rx, idle_tx, finished_tx) =
+                (&ctx, frame_rx.clone(), idle_tx.clone(), finished_tx.clone().unwrap());
+            cs.builder().name(format!("invoke-{}", i)).spawn(move |_| {
+                run_invoker(ctx, frame_rx, idle_tx, finished_tx)
             }).unwrap();
-            info!("Decoder thread ending after {:?}", before.elapsed());
-            info!("asdf");
-        });
+        }
+
+        // Lease renewal and queue sampling threads. These run until the writer is done.
+        let (stop_tx, stop_rx) = crossbeam::channel::bounded(0);
+        {
+            let (ctx, stop_rx) = (&ctx, stop_rx.clone());
+            cs.builder().name("lease-renewer".to_owned()).spawn(move |_| {
+                run_lease_renewer(ctx, stop_rx)
+            }).unwrap();
+        }
+        {
+            let (ctx, decode_rx, idle_rx, finished_rx) =
+                (&ctx, &decode_rx, &idle_rx, finished_rx.clone());
+            cs.builder().name("sampler".to_owned()).spawn(move |_| {
+                run_sampler(ctx, decode_rx, idle_rx, &frame_rx, &finished_rx, stop_rx)
+            }).unwrap();
+        }
+
+        // Writer thread.
+        {
+            let (ctx, streams, progress) = (&ctx, &streams, &progress);
+            cs.builder().name("writer".to_owned()).spawn(move |_| {
+                // Renew leases and sample until everything claimed is written.
+                let _stop_tx = stop_tx;
+                let stats = run_writer(ctx, streams, finished_rx, |n| {
+                    let frames_processed = ctx.frames_processed.load(Ordering::Relaxed);
+                    let elapsed = start.elapsed();
+                    info!("rate = {:.1} fps", frames_processed as f32 / elapsed.as_secs_f32());
+                    progress.inc(u64::try_from(n).unwrap());
+                }).unwrap();
+                if stats.commits > 0 {
+                    info!("Writer finishing; {} rows in {} commits (mean batch {:.1}, max {}); \
+                           commit latency mean {:?}, max {:?}",
+                          stats.rows, stats.commits, stats.rows as f32 / stats.commits as f32,
+                          stats.max_batch,
+                          stats.total_latency / u32::try_from(stats.commits).unwrap(),
+                          stats.max_latency);
+                }
+            }).unwrap();
+        }
 
-        // Fetch thread.
-        // TODO: fetch thread per sample file dir? or maybe unnecessary, fast enough as is.
-        s.spawn(|_| {
-            let mut stream_i = 0;
-            let mut fetch_time = std::time::Duration::new(0, 0);
-            let mut send_time = std::time::Duration::new(0, 0);
-            let decode_tx = decode_tx.take().unwrap();
-            for s in &stuff {
-                if let Some((stream, ids)) = s {
-                    for &id in ids {
-                        let before = std::time::Instant::now();
-                        let body = rt.block_on(fetch_recording(&ctx, &stream, id)).unwrap();
-                        let between = std::time::Instant::now();
-                        decode_tx.send(Recording {
-                            stream_i,
-                            id,
-                            body,
-                        }).unwrap();
-                        let after = std::time::Instant::now();
-                        fetch_time += between.checked_duration_since(before).unwrap();
-                        send_time += after.elapsed();
+        rayon::scope(|s| {
+            // Decoder threads.
+            s.spawn(|_| {
+                let before = Instant::now();
+                info!("Decoder thread starting");
+                let frame_tx = frame_tx.take().unwrap();
+                let finished_tx = finished_tx.take().unwrap();
+                decode_rx.iter().par_bridge().for_each(|r: Recording| {
+                    // A failed recording (such as a truncated download) shouldn't stop the
+                    // others. Return it to the queue for another try.
+                    let (stream, id) = (streams[r.stream_i as usize], r.id);
+                    if let Err(e) = decode_recording(&ctx, r, &idle_rx, &frame_tx, &finished_tx) {
+                        warn!("{}/{} recording {}: {}; returning it to the queue",
+                              stream.camera_short_name, stream.stream_name, id, e);
+                        if let Err(e) = release(&ctx, stream, id) {
+                            warn!("unable to return {}/{} recording {} to the queue: {}",
+                                  stream.camera_short_name, stream.stream_name, id, e);
+                        }
                     }
-                    stream_i += 1;
+                });
+                info!("Decoder thread ending after {:?}", before.elapsed());
+            });
+
+            // Fetch thread.
+            s.spawn(|_| {
+                let before = Instant::now();
+                let decode_tx = decode_tx.take().unwrap();
+                // On error, dropping decode_tx lets the rest of the pipeline finish what was
+                // fetched before main returns the error.
+                match rt.block_on(fetch_all(&ctx, &streams, decode_tx)) {
+                    Ok(send_time) => info!("Fetch finishing after {:?}; decode queue send \
+                                            time={:?}", before.elapsed(), send_time),
+                    Err(e) => fetch_result = Err(e),
                 }
-            }
-            info!("Fetch finishing; fetch time={:?} send time={:?}", fetch_time, send_time);
+            });
         });
-    });
+    }).unwrap();
 
     progress.finish();
-    Ok(())
+    let skipped = ctx.frames_skipped.load(Ordering::Relaxed);
+    let tracked = ctx.frames_tracked.load(Ordering::Relaxed);
+    let processed = ctx.frames_processed.load(Ordering::Relaxed);
+    if opt.motion_threshold > 0 {
+        info!("Motion gate reused detections for {} of {} selected frames",
+              skipped, skipped + tracked + processed);
+    }
+    if opt.detect_interval.is_some() {
+        info!("Tracking carried boxes forward for {} of {} analyzed frames",
+              tracked, tracked + processed);
+    }
+    info!("Stage timings:\n{}", ctx.metrics.summary());
+    if let Some(p) = opt.trace_file.as_ref() {
+        ctx.metrics.write_trace(std::fs::File::create(p)?)?;
+        info!("Wrote trace to {}", p.display());
+    }
+    fetch_result
 }
 
 #[cfg(test)]
 mod test {
     #[test]
-    fn filter() {
-        let mut from = vec![1, 3, 5, 10, 20];
-        super::filter_sorted(&mut from, [1, 2, 3, 8, 20].iter());
-        assert_eq!(&from, &[5, 10]);
+    fn interleave() {
+        let lists: [&[i32]; 3] = [&[1, 2, 3], &[], &[10]];
+        assert_eq!(super::interleave(&lists), &[(0, 1), (2, 10), (0, 2), (0, 3)]);
+    }
+
+    #[test]
+    fn objects_round_trip() {
+        let o = nvr_analytics::webvtt::Object {
+            label: "person",
+            score: 1.,
+            x: 0.,
+            y: 0.2,
+            w: 0.4,
+            h: 1.,
+            track: Some(3),
+        };
+        let mut data = Vec::new();
+        super::append_objects(&[o.clone(), o], &mut data);
+        assert_eq!(data, &[2, 0, 0, 102, 51, 255, 255, 0, 0, 102, 51, 255, 255]);
+        let mut objs = Vec::new();
+        super::parse_frame(&data, &mut objs).unwrap();
+        assert_eq!(objs.len(), 2);
+        assert_eq!(objs[0].label, "person");
+        assert_eq!((objs[0].x, objs[0].h, objs[0].score), (0., 1., 1.));
+        assert!((objs[0].w - 0.4).abs() < 1. / 255.);
+        assert!(objs[0].track.is_none());
+        assert!(super::parse_frame(&data[..5], &mut objs).is_err());
     }
 }
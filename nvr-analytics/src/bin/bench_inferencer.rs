@@ -0,0 +1,340 @@
+//! Load generator for the inferencer server.
+//!
+//! Simulates a number of concurrent camera streams, each sending blank images of the model's
+//! input size (or, with `--rpc=video`, replaying a `.mp4` file), and reports throughput and
+//! latency for each RPC and stream count. All cameras share one HTTP/2 connection, as they
+//! would from one NVR.
+//!
+//! In closed-loop mode (the default), each camera keeps `--in-flight` images outstanding, which
+//! measures the server's capacity. In open-loop mode (`--rate`), each camera sends images on a
+//! fixed schedule regardless of how quickly the server responds, as real cameras do. Latency is
+//! measured from each image's scheduled time, so a server which falls behind shows growing
+//! latency rather than a slower send rate.
+//!
+//! To benchmark the serving path on a machine without an Edge TPU, run the server with
+//! `--mock-interpreters` or `--cpu-interpreters`.
+
+use futures::{StreamExt, TryStreamExt};
+use proto::inferencer_client::InferencerClient;
+use std::collections::HashMap;
+use std::ffi::CString;
+use std::os::unix::ffi::OsStrExt;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+use structopt::StructOpt;
+
+type BoxedError = Box<dyn std::error::Error + 'static>;
+type Client = InferencerClient<tonic::transport::Channel>;
+
+mod proto {
+    tonic::include_proto!("org.moonfire_nvr.inferencer");
+}
+
+#[derive(StructOpt)]
+struct Opt {
+    /// The inferencer server: a URL, or `unix:<path>` for its Unix domain socket.
+    #[structopt(long, default_value = "http://127.0.0.1:8085")]
+    server: String,
+
+    /// RPCs to try, comma-separated: unary (ProcessImage), stream (ProcessImageStream), and/or
+    /// video (ProcessVideo, which requires --video).
+    #[structopt(long, default_value = "unary,stream", use_delimiter = true)]
+    rpc: Vec<Rpc>,
+
+    /// Numbers of concurrent camera streams to try, comma-separated.
+    #[structopt(long, default_value = "1,10,50", use_delimiter = true)]
+    streams: Vec<usize>,
+
+    /// Seconds to run each configuration.
+    #[structopt(long, default_value = "10")]
+    secs: u64,
+
+    /// In closed-loop mode, the images each camera keeps in flight at once.
+    #[structopt(long, default_value = "1")]
+    in_flight: usize,
+
+    /// Images per second to send from each camera. If set, runs in open-loop mode.
+    #[structopt(long)]
+    rate: Option<f64>,
+
+    /// A `.mp4` file of H.264 video for `--rpc=video` to send, repeating as necessary. It
+    /// shouldn't have B-frames, so that each packet's frame is decoded as soon as it arrives.
+    #[structopt(long, parse(from_os_str))]
+    video: Option<std::path::PathBuf>,
+}
+
+#[derive(Copy, Clone, Debug, Eq, PartialEq)]
+enum Rpc {
+    Unary,
+    Stream,
+    Video,
+}
+
+impl std::str::FromStr for Rpc {
+    type Err = String;
+
+    fn from_str(s: &str) -> Result<Self, Self::Err> {
+        match s {
+            "unary" => Ok(Rpc::Unary),
+            "stream" => Ok(Rpc::Stream),
+            "video" => Ok(Rpc::Video),
+            _ => Err(format!("unknown rpc {:?}; expected unary, stream, or video", s)),
+        }
+    }
+}
+
+#[derive(Copy, Clone)]
+enum Load {
+    Closed { in_flight: usize },
+    Open { interval: Duration },
+}
+
+/// What each camera sends.
+struct Workload {
+    image: proto::ProcessImageRequest,
+    video: Option<Video>,
+}
+
+struct Video {
+    init_segment: Vec<u8>,
+
+    /// Each video packet of the file, length-prefixed as in the `.mp4`.
+    packets: Vec<Vec<u8>>,
+}
+
+/// Latencies of completed images. All are kept, so percentiles are exact.
+struct Latencies(parking_lot::Mutex<Vec<Duration>>);
+
+impl Latencies {
+    fn record(&self, d: Duration) { self.0.lock().push(d); }
+
+    fn into_sorted(self) -> Vec<Duration> {
+        let mut l = self.0.into_inner();
+        l.sort();
+        l
+    }
+}
+
+fn percentile(sorted: &[Duration], p: f64) -> Duration {
+    if sorted.is_empty() {
+        return Duration::from_secs(0);
+    }
+    let i = std::cmp::max(1, (p * sorted.len() as f64).ceil() as usize) - 1;
+    sorted[std::cmp::min(i, sorted.len() - 1)]
+}
+
+/// Sends the image with the given sequence number.
+type Sender = Box<dyn FnMut(u64) -> Result<(), tonic::Status> + Send>;
+
+/// Yields the sequence number of each image as its result arrives.
+type Completions = std::pin::Pin<Box<
+    dyn futures::Stream<Item = Result<u64, tonic::Status>> + Send>>;
+
+fn closed() -> tonic::Status {
+    tonic::Status::new(tonic::Code::Internal, "request stream closed")
+}
+
+/// Starts a camera's call(s) with the given RPC.
+fn start_camera(rpc: Rpc, client: &Client, workload: &Arc<Workload>) -> (Sender, Completions) {
+    let mut client = client.clone();
+    let workload = workload.clone();
+    match rpc {
+        Rpc::Unary => {
+            let (tx, rx) = futures::channel::mpsc::unbounded();
+            let completions = rx.map(move |seq| {
+                let mut client = client.clone();
+                let request = workload.image.clone();
+                async move { client.process_image(request).await.map(|_| seq) }
+            }).buffer_unordered(usize::max_value());
+            (Box::new(move |seq| tx.unbounded_send(seq).map_err(|_| closed())),
+             Box::pin(completions))
+        },
+        Rpc::Stream => {
+            let (tx, rx) = futures::channel::mpsc::unbounded();
+            let completions = futures::stream::once(async move {
+                client.process_image_stream(rx).await
+            }).map_ok(|resp| resp.into_inner().and_then(|r| async move {
+                if r.error_code != 0 {
+                    return Err(tonic::Status::new(tonic::Code::from_i32(r.error_code),
+                                                  r.error_message));
+                }
+                Ok(r.sequence_number)
+            })).try_flatten();
+            let send = move |seq| {
+                tx.unbounded_send(proto::ProcessImageStreamRequest {
+                    sequence_number: seq,
+                    request: Some(workload.image.clone()),
+                }).map_err(|_| closed())
+            };
+            (Box::new(send), Box::pin(completions))
+        },
+        Rpc::Video => {
+            // With no B-frames and a frame interval of 1, packet n yields frame n.
+            let (tx, rx) = futures::channel::mpsc::unbounded();
+            let completions = futures::stream::once(async move {
+                client.process_video(rx).await
+            }).map_ok(|resp| resp.into_inner().map_ok(|r| {
+                futures::stream::iter(r.frame.into_iter().map(|f| Ok(f.frame_index)))
+            }).try_flatten()).try_flatten();
+            let send = move |seq| {
+                let video = workload.video.as_ref().unwrap();
+                let mut request = proto::ProcessVideoRequest {
+                    priority: workload.image.priority,
+                    packet: vec![video.packets[seq as usize % video.packets.len()].clone()],
+                    ..Default::default()
+                };
+                if seq == 0 {
+                    request.init_segment = video.init_segment.clone();
+                    request.model_uuid = workload.image.model_uuid.clone();
+                    request.frame_interval = 1;
+                }
+                tx.unbounded_send(request).map_err(|_| closed())
+            };
+            (Box::new(send), Box::pin(completions))
+        },
+    }
+}
+
+/// Removes `seq` from `sent`, recording its latency.
+fn complete(sent: &mut HashMap<u64, Instant>, seq: u64, latencies: &Latencies)
+            -> Result<(), tonic::Status> {
+    let start = sent.remove(&seq).ok_or_else(|| {
+        tonic::Status::new(tonic::Code::Internal, format!("unexpected sequence number {}", seq))
+    })?;
+    latencies.record(start.elapsed());
+    Ok(())
+}
+
+/// Runs one camera until `end`, then waits for its outstanding images.
+async fn run_camera(mut send: Sender, mut completions: Completions, load: Load, end: Instant,
+                    latencies: &Latencies) -> Result<(), tonic::Status> {
+    let mut sent = HashMap::new();  // sequence number -> start time.
+    let mut next_seq = 0;
+    match load {
+        Load::Closed { in_flight } => {
+            for _ in 0..in_flight {
+                sent.insert(next_seq, Instant::now());
+                send(next_seq)?;
+                next_seq += 1;
+            }
+            while let Some(seq) = completions.try_next().await? {
+                complete(&mut sent, seq, latencies)?;
+                if Instant::now() < end {
+                    sent.insert(next_seq, Instant::now());
+                    send(next_seq)?;
+                    next_seq += 1;
+                } else if sent.is_empty() {
+                    return Ok(());
+                }
+            }
+        },
+        Load::Open { interval } => {
+            let start = Instant::now();
+            loop {
+                let next = start + interval.mul_f64(next_seq as f64);
+                let sending = next < end;
+                if !sending && sent.is_empty() {
+                    return Ok(());
+                }
+                tokio::select! {
+                    _ = tokio::time::sleep_until(next.into()), if sending => {
+                        sent.insert(next_seq, next);
+                        send(next_seq)?;
+                        next_seq += 1;
+                    },
+                    seq = completions.try_next() => match seq? {
+                        Some(seq) => complete(&mut sent, seq, latencies)?,
+                        None => break,
+                    },
+                }
+            }
+        },
+    }
+    Err(tonic::Status::new(tonic::Code::Internal,
+                           format!("server finished with {} images outstanding", sent.len())))
+}
+
+fn read_video(path: &std::path::Path) -> Result<Video, BoxedError> {
+    let file = std::fs::read(path)?;
+    let init_segment = nvr_analytics::h264::init_segment(&file).map_err(|e| e.to_string())?;
+    moonfire_ffmpeg::Ffmpeg::new();
+    let url = CString::new(path.as_os_str().as_bytes())?;
+    let mut open_options = moonfire_ffmpeg::avutil::Dictionary::new();
+    let mut input = moonfire_ffmpeg::avformat::InputFormatContext::open(&url, &mut open_options)
+        .map_err(|e| e.to_string())?;
+    input.find_stream_info().map_err(|e| e.to_string())?;
+
+    // In .mp4 files generated by Moonfire NVR, the video is always stream 0.
+    const VIDEO_STREAM: usize = 0;
+    let mut packets = Vec::new();
+    loop {
+        let pkt = match input.read_frame() {
+            Ok(p) => p,
+            Err(e) if e.is_eof() => break,
+            Err(e) => return Err(e.to_string().into()),
+        };
+        if pkt.stream_index() == VIDEO_STREAM {
+            packets.push(pkt.data().unwrap_or(&[]).to_vec());
+        }
+    }
+    if packets.is_empty() {
+        return Err(format!("no video packets in {}", path.display()).into());
+    }
+    Ok(Video {
+        init_segment,
+        packets,
+    })
+}
+
+#[tokio::main]
+async fn main() -> Result<(), BoxedError> {
+    let mut h = nvr_analytics::init_logging();
+    let _a = h.async_scope();
+    let opt = Opt::from_args();
+    let video = match (opt.rpc.contains(&Rpc::Video), opt.video.as_ref()) {
+        (false, _) => None,
+        (true, None) => return Err("--rpc=video requires --video".into()),
+        (true, Some(p)) => Some(read_video(p)?),
+    };
+    let channel = nvr_analytics::transport::connect(&opt.server).await?;
+    let mut client = InferencerClient::new(channel);
+    let model = client.list_models(proto::ListModelsRequest {}).await?.into_inner().model
+        .into_iter().next()
+        .ok_or_else(|| tonic::Status::new(tonic::Code::NotFound, "server has no models"))?;
+    let input = model.input_parameters.as_ref().ok_or("model has no input parameters")?;
+    let workload = Arc::new(Workload {
+        image: proto::ProcessImageRequest {
+            model_uuid: model.uuid.clone(),
+            image: vec![0; 3 * input.width as usize * input.height as usize],
+            ..Default::default()
+        },
+        video,
+    });
+    let (load, load_name) = match opt.rate {
+        None => (Load::Closed { in_flight: opt.in_flight }, format!("closed/{}", opt.in_flight)),
+        Some(r) => (Load::Open { interval: Duration::from_secs_f64(1. / r) },
+                    format!("open/{}/s", r)),
+    };
+    let duration = Duration::from_secs(opt.secs);
+
+    println!("{:<6} {:<12} {:>7} {:>9} {:>10} {:>10} {:>10} {:>10} {:>10}",
+             "rpc", "load", "streams", "images", "images/s", "p50", "p90", "p99", "max");
+    for &rpc in &opt.rpc {
+        for &streams in &opt.streams {
+            let latencies = Latencies(parking_lot::Mutex::new(Vec::new()));
+            let start = Instant::now();
+            let end = start + duration;
+            futures::future::try_join_all((0..streams).map(|_| {
+                let (send, completions) = start_camera(rpc, &client, &workload);
+                run_camera(send, completions, load, end, &latencies)
+            })).await?;
+            let elapsed = start.elapsed();
+            let l = latencies.into_sorted();
+            println!("{:<6} {:<12} {:>7} {:>9} {:>10.1} {:>10.3?} {:>10.3?} {:>10.3?} {:>10.3?}",
+                     format!("{:?}", rpc).to_lowercase(), load_name, streams, l.len(),
+                     l.len() as f64 / elapsed.as_secs_f64(), percentile(&l, 0.5),
+                     percentile(&l, 0.9), percentile(&l, 0.99), percentile(&l, 1.));
+        }
+    }
+    Ok(())
+}
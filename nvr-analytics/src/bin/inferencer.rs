@@ -1,14 +1,18 @@
 //! Writes a WebVTT metadata caption file representing all of the objects detected in the given
-//! .mp4 file. Each cue represents a single object for a single frame.
+//! .mp4 file. Each cue represents a single object for a single frame, or with `--coalesce-iou`
+//! for a run of frames.
 
 //use cstr::*;
+use futures::StreamExt;
 use moonfire_ffmpeg::avutil::{Rational, VideoFrame};
+use nvr_analytics::transport::{Ring, Slot};
+use nvr_analytics::webvtt::{Object, Writer};
 use proto::inferencer_client::InferencerClient;
-use serde::Serialize;
 use std::convert::TryFrom;
-use std::env;
 use std::ffi::CString;
-use std::io::Write;
+use std::sync::Arc;
+use structopt::StructOpt;
+use tokio::sync::{mpsc, oneshot};
 
 type BoxedError = Box<dyn std::error::Error + 'static>;
 
@@ -18,77 +22,60 @@ mod proto {
     tonic::include_proto!("org.moonfire_nvr.inferencer");
 }
 
-/// Copies from a RGB24 VideoFrame to a 1xHxWx3 Tensor.
-fn extract(from: &VideoFrame) -> Vec<u8> {
-    let from = from.plane(0);
-    let (w, h) = (from.width, from.height);
-    let mut to = vec![0; w * h * 3];
-    let mut from_i = 0;
-    let mut to_i = 0;
-    for _y in 0..h {
-        to[to_i..to_i+3*w].copy_from_slice(&from.data[from_i..from_i+3*w]);
-        from_i += from.linesize;
-        to_i += 3*w;
-    }
-    to
-}
+#[derive(StructOpt)]
+struct Opt {
+    /// The inferencer server: a URL, or `unix:<path>` for its Unix domain socket.
+    #[structopt(long, default_value = "http://192.168.8.3:8085")]
+    server: String,
 
-#[derive(Serialize)]
-struct Object<'m> {
-    label: &'m str,
-    score: f32,
-    x: f32,
-    y: f32,
-    w: f32,
-    h: f32,
-}
+    /// Pass frames to the server through shared memory. Requires a `unix:` server.
+    #[structopt(long)]
+    shared_memory: bool,
 
-struct Pts(i64, Rational);
-
-impl std::fmt::Display for Pts {
-    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
-        // https://www.w3.org/TR/webvtt1/#webvtt-timestamp
-        let seconds = self.0 as f64 * self.1.num as f64 / self.1.den as f64;
-        let minutes = (seconds / 60.).trunc();
-        let seconds = seconds % 60.;
-        let hours = (minutes / 60.).trunc();
-        let minutes = minutes % 60.;
-        write!(f, "{:02.0}:{:02.0}:{:06.3}", hours, minutes, seconds)
-    }
-}
+    /// The number of frames to have outstanding with the server at once.
+    #[structopt(long, default_value = "8")]
+    in_flight: usize,
 
-fn write_objs(mut stdout: &mut dyn Write, start: Pts, end: Pts, objs: &[Object])
-              -> std::io::Result<()> {
-    for o in objs {
-        write!(stdout, "{} --> {}\n", start, end)?;
-        serde_json::to_writer(&mut stdout, o)?;
-        write!(stdout, "\n\n")?;
-    }
-    if !objs.is_empty() {
-        stdout.flush()?;
-    }
-    Ok(())
-}
+    /// Reuse the previous detections for frames whose luma differs from the last analyzed
+    /// frame's by at most this much per pixel (averaged over each 16x16 block). 0 analyzes
+    /// every frame.
+    #[structopt(long, default_value = "0")]
+    motion_threshold: u8,
 
-async fn get_model(client: &mut InferencerClient<tonic::transport::Channel>)
-                   -> Result<proto::Model, BoxedError> {
-    let req = tonic::Request::new(proto::ListModelsRequest {});
-    let mut resp = client.list_models(req).await?.into_inner();
-    if resp.model.len() != 1 {
-        return Err(Box::new(tonic::Status::new(tonic::Code::Internal,
-                                               "expected exactly one model")))?;
-    }
-    Ok(resp.model.remove(0))
+    /// Merge an object's cues across frames while each frame has an object with the same label
+    /// whose box has at least this intersection over union with the cue's. Unset writes a cue
+    /// per object per frame.
+    #[structopt(long)]
+    coalesce_iou: Option<f32>,
+
+    /// The video to analyze.
+    url: String,
 }
 
-#[tokio::main]
-async fn main() -> Result<(), BoxedError> {
-    let mut client = InferencerClient::connect("http://192.168.8.3:8085").await?;
+/// A decoded frame, scaled and ready to send.
+struct Frame {
+    pts: i64,
 
-    let model = get_model(&mut client).await?;
+    /// False if the motion gate found nothing changed, so the frame needn't be sent.
+    changed: bool,
+    image: Vec<u8>,
 
-    let url = env::args().nth(1).expect("missing url");
-    let _ffmpeg = moonfire_ffmpeg::Ffmpeg::new();
+    /// With `--shared-memory`, the slot holding the image (in place of `image`) and its name
+    /// on the server.
+    shared: Option<(Slot, proto::SharedMemorySlot)>,
+}
+
+/// The decoded video stream's parameters, sent before its first frame.
+struct StreamInfo {
+    time_base: Rational,
+    duration: i64,
+}
+
+/// Decodes and scales frames from `url` to `width`x`height` on the calling thread, sending them
+/// until the video ends or the receiver hangs up.
+fn decode(url: String, width: u32, height: u32, ring: Option<(Arc<Ring>, u64)>,
+          mut gate: nvr_analytics::motion::Gate, info_tx: oneshot::Sender<StreamInfo>,
+          frame_tx: mpsc::Sender<Frame>) {
     let mut open_options = moonfire_ffmpeg::avutil::Dictionary::new();
     let mut input = moonfire_ffmpeg::avformat::InputFormatContext::open(&CString::new(url).unwrap(),
                                                               &mut open_options).unwrap();
@@ -99,33 +86,22 @@ async fn main() -> Result<(), BoxedError> {
     const VIDEO_STREAM: usize = 0;
 
     let stream = input.streams().get(VIDEO_STREAM);
-    let time_base = stream.time_base();
+    let _ = info_tx.send(StreamInfo {
+        time_base: stream.time_base(),
+        duration: stream.duration(),
+    });
     let par = stream.codecpar();
     let mut dopt = moonfire_ffmpeg::avutil::Dictionary::new();
     //dopt.set(cstr!("refcounted_frames"), cstr!("0")).unwrap();  // TODO?
     let d = par.new_decoder(&mut dopt).unwrap();
 
-    let model_par = match model.input_parameters.as_ref() {
-        None => panic!("model must return input parameters"),
-        Some(p) => p,
-    };
-
     let mut scaled = VideoFrame::owned(moonfire_ffmpeg::avutil::ImageDimensions {
-        width: i32::try_from(model_par.width).unwrap(),
-        height: i32::try_from(model_par.height).unwrap(),
-        pix_fmt: if model_par.pixel_format == (proto::PixelFormat::Rgb24 as i32) {
-            moonfire_ffmpeg::avutil::PixelFormat::rgb24()
-        } else {
-            panic!("Unknown pixel format {}", model_par.pixel_format);
-        },
+        width: i32::try_from(width).unwrap(),
+        height: i32::try_from(height).unwrap(),
+        pix_fmt: moonfire_ffmpeg::avutil::PixelFormat::rgb24(),
     }).unwrap();
     let mut f = VideoFrame::empty().unwrap();
     let mut s = moonfire_ffmpeg::swscale::Scaler::new(par.dims(), scaled.dims()).unwrap();
-    let mut prev_pts = 0;
-    let mut prev_objs: Vec<Object> = Vec::new();
-    let stdout = std::io::stdout();
-    let mut stdout = stdout.lock();
-    write!(&mut stdout, "WEBVTT\n\n").unwrap();
     loop {
         let pkt = match input.read_frame() {
             Ok(p) => p,
@@ -138,41 +114,183 @@ async fn main() -> Result<(), BoxedError> {
         if !d.decode_video(&pkt, &mut f).unwrap() {
             continue;
         }
-        write_objs(&mut stdout, Pts(prev_pts, time_base), Pts(f.pts(), time_base),
-                   &prev_objs).unwrap();
-        prev_objs.clear();
-        prev_pts = f.pts();
+        if !gate.changed(&f) {
+            let frame = Frame {
+                pts: f.pts(),
+                changed: false,
+                image: Vec::new(),
+                shared: None,
+            };
+            if frame_tx.blocking_send(frame).is_err() {
+                break;
+            }
+            continue;
+        }
         s.scale(&f, &mut scaled);
-        let image = extract(&scaled);
-        let response = client.process_image(proto::ProcessImageRequest {
-            priority: 0,
-            model_uuid: model.uuid.clone(),
-            image,
-        }).await.unwrap();
-        let response = response.into_inner();
-        let result = response.result.unwrap().model_result.unwrap();
-        let result = match result {
-            proto::image_result::ModelResult::ObjectDetectionResult(r) => r,
+        let frame = match ring.as_ref() {
+            None => Frame {
+                pts: f.pts(),
+                changed: true,
+                image: nvr_analytics::to_vec(&scaled),
+                shared: None,
+            },
+            Some((ring, region_id)) => {
+                // The ring has a slot for every frame which can be queued or outstanding.
+                let mut slot = ring.try_acquire().expect("ring has a free slot");
+                nvr_analytics::copy_to_slice(&scaled, slot.bytes_mut());
+                let name = proto::SharedMemorySlot {
+                    region_id: *region_id,
+                    slot: slot.index(),
+                };
+                Frame {
+                    pts: f.pts(),
+                    changed: true,
+                    image: Vec::new(),
+                    shared: Some((slot, name)),
+                }
+            },
         };
-        for i in 0..result.score.len() {
-            if result.score[i] < SCORE_THRESHOLD {
-                continue;
+        if frame_tx.blocking_send(frame).is_err() {
+            break;
+        }
+    }
+}
+
+async fn get_model(client: &mut InferencerClient<tonic::transport::Channel>)
+                   -> Result<proto::Model, BoxedError> {
+    let req = tonic::Request::new(proto::ListModelsRequest {});
+    let mut resp = client.list_models(req).await?.into_inner();
+    if resp.model.len() != 1 {
+        return Err(Box::new(tonic::Status::new(tonic::Code::Internal,
+                                               "expected exactly one model")))?;
+    }
+    Ok(resp.model.remove(0))
+}
+
+#[tokio::main]
+async fn main() -> Result<(), BoxedError> {
+    let opt = Opt::from_args();
+    if opt.in_flight == 0 {
+        return Err("--in-flight must be positive".into());
+    }
+    let client = InferencerClient::new(nvr_analytics::transport::connect(&opt.server).await?);
+
+    let model = get_model(&mut client.clone()).await?;
+    let model_par = match model.input_parameters.as_ref() {
+        None => panic!("model must return input parameters"),
+        Some(p) => p,
+    };
+    if model_par.pixel_format != (proto::PixelFormat::Rgb24 as i32) {
+        panic!("Unknown pixel format {}", model_par.pixel_format);
+    }
+
+    // With --shared-memory, frames are scaled straight into slots of a ring. Up to `in_flight`
+    // frames are outstanding, `in_flight` more are queued, and the decoder fills one more.
+    let ring = if opt.shared_memory {
+        let ring = Ring::new(3 * model_par.width as usize * model_par.height as usize,
+                             u32::try_from(2 * opt.in_flight + 1)?)?;
+        let region_id = client.clone().attach_shared_memory(proto::AttachSharedMemoryRequest {
+            fd: ring.fd(),
+            slot_len: u32::try_from(ring.slot_len()).unwrap(),
+            slots: ring.slots(),
+        }).await?.into_inner().region_id;
+        Some((ring, region_id))
+    } else {
+        None
+    };
+
+    let region_id = ring.as_ref().map(|&(_, id)| id);
+
+    // Decode on a separate thread so it overlaps with the server's work on earlier frames.
+    let _ffmpeg = moonfire_ffmpeg::Ffmpeg::new();
+    let (info_tx, info_rx) = oneshot::channel();
+    let (frame_tx, frame_rx) = mpsc::channel(opt.in_flight);
+    let (url, width, height) = (opt.url.clone(), model_par.width, model_par.height);
+    let gate = nvr_analytics::motion::Gate::new(opt.motion_threshold);
+    let decoder = std::thread::Builder::new()
+        .name("decoder".to_owned())
+        .spawn(move || decode(url, width, height, ring, gate, info_tx, frame_tx))?;
+    let info = match info_rx.await {
+        Ok(i) => i,
+        Err(_) => return Err("decoder failed to open input".into()),
+    };
+    let time_base = info.time_base;
+
+    // Keep up to `in_flight` requests outstanding. `buffered` yields responses in the order the
+    // frames were decoded, which is pts order, so they can be written as they come. Unchanged
+    // frames yield `None` without a request.
+    let frames = futures::stream::unfold(frame_rx, |mut rx| async move {
+        rx.recv().await.map(|f| (f, rx))
+    });
+    let model_uuid = &model.uuid;
+    let mut results = frames.map(|frame| {
+        let mut client = client.clone();
+        async move {
+            if !frame.changed {
+                return Ok((frame.pts, None));
             }
-            let label = match model.labels.get(&result.label[i]) {
-                None => continue,
-                Some(l) => l.as_str(),
+            let (slot, shared_image) = match frame.shared {
+                None => (None, None),
+                Some((slot, name)) => (Some(slot), Some(name)),
             };
-            prev_objs.push(Object {
-                y: result.y[i],
-                x: result.x[i],
-                h: result.h[i],
-                w: result.w[i],
-                label,
-                score: result.score[i],
-            });
+            let response = client.process_image(proto::ProcessImageRequest {
+                priority: 0,
+                model_uuid: model_uuid.clone(),
+                image: frame.image,
+                shared_image,
+                filter: Some(proto::DetectionFilter {
+                    min_score: SCORE_THRESHOLD,
+                    ..Default::default()
+                }),
+                ..Default::default()
+            }).await;
+
+            // The server is done with the slot once it has responded.
+            drop(slot);
+            response.map(|r| (frame.pts, Some(r.into_inner())))
         }
+    }).buffered(opt.in_flight);
+
+    let mut objs: Vec<Object> = Vec::new();
+    let stdout = std::io::stdout();
+    let mut out = Writer::new(stdout.lock(), time_base, opt.coalesce_iou)?;
+    while let Some(r) = results.next().await {
+        let (pts, response) = r?;
+
+        // With no response, nothing's moved; the previous frame's objects carry over.
+        if let Some(response) = response {
+            objs.clear();
+            let result = response.result.unwrap().model_result.unwrap();
+            let result = match result {
+                proto::image_result::ModelResult::ObjectDetectionResult(r) => r,
+            };
+            for i in 0..result.score.len() {
+                let label = match model.labels.get(&result.label[i]) {
+                    None => continue,
+                    Some(l) => l.as_str(),
+                };
+                objs.push(Object {
+                    y: result.y[i],
+                    x: result.x[i],
+                    h: result.h[i],
+                    w: result.w[i],
+                    label,
+                    score: result.score[i],
+                    track: None,
+                });
+            }
+        }
+        out.frame(pts, &objs)?;
+    }
+    if decoder.join().is_err() {
+        return Err("decoder panicked".into());
+    }
+
+    // The server also drops the region when the connection closes, as on an earlier error.
+    if let Some(region_id) = region_id {
+        client.clone().detach_shared_memory(proto::DetachSharedMemoryRequest { region_id })
+            .await?;
     }
-    write_objs(&mut stdout, Pts(prev_pts, time_base), Pts(stream.duration(), time_base),
-               &prev_objs).unwrap();
+    out.finish(info.duration)?;
     Ok(())
 }
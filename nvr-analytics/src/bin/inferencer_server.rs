@@ -1,7 +1,20 @@
+use cstr::*;
+use futures::{SinkExt, StreamExt};
+use log::{info, warn};
+use moonfire_ffmpeg::avutil::VideoFrame;
+use nvr_analytics::metrics::Histogram;
+use nvr_analytics::streaming::StreamingBody;
+use prost::Message;
 use proto::inferencer_server::{Inferencer, InferencerServer};
-use std::collections::HashMap;
+use std::borrow::Cow;
+use std::collections::{BTreeMap, BinaryHeap, HashMap};
 use std::convert::TryFrom;
-use tokio::sync::Mutex;
+use std::os::unix::io::AsRawFd;
+use std::sync::Arc;
+use std::time::{Duration, Instant};
+use structopt::StructOpt;
+use tokio::io::AsyncWriteExt;
+use tokio::sync::oneshot;
 
 type BoxedError = Box<dyn std::error::Error + 'static>;
 
@@ -12,64 +25,817 @@ mod proto {
 
 //const MODEL_UUID: Uuid = Uuid::from_u128(0x4d1c73aa_b6ef_4986_a01d_3abe94693c4c);
 
-struct MyInferencer {
-    interpreter: Mutex<moonfire_tflite::Interpreter<'static>>,
+#[derive(StructOpt)]
+struct Opt {
+    /// A directory of models to serve, each a serialized `ModelData` message named
+    /// `<uuid>.model`, as written by `add_model`. Send SIGHUP to reload.
+    #[structopt(long, parse(from_os_str))]
+    model_dir: Option<std::path::PathBuf>,
+
+    /// A database whose `object_detection_model` rows with `data` to serve. Send SIGHUP to
+    /// reload. If neither this nor `--model-dir` is given, serves the built-in model.
+    #[structopt(long, parse(from_os_str))]
+    db: Option<std::path::PathBuf>,
+
+    /// The number of CPU interpreters to run per model which has a CPU version, in addition to
+    /// one per Edge TPU.
+    #[structopt(long, default_value="0")]
+    cpu_interpreters: usize,
+
+    /// A CPU version of the built-in model, which is compiled for the Edge TPU. It must have
+    /// the same inputs, outputs, and labels.
+    #[structopt(long, parse(from_os_str))]
+    cpu_model: Option<std::path::PathBuf>,
+
+    /// The number of mock interpreters to run, for benchmarking the serving path on a machine
+    /// without an Edge TPU. They're scheduled as Edge TPUs but detect nothing.
+    #[structopt(long, default_value="0")]
+    mock_interpreters: usize,
+
+    /// How long each mock interpreter invocation takes, in milliseconds.
+    #[structopt(long, default_value="10")]
+    mock_invoke_ms: u64,
+
+    /// Also listen on a Unix domain socket at this path. Clients on the same host connecting
+    /// through it can pass images through shared memory.
+    #[structopt(long, parse(from_os_str))]
+    uds: Option<std::path::PathBuf>,
+}
+
+/// The kind of device an interpreter runs on.
+#[derive(Copy, Clone, Debug, Eq, PartialEq)]
+enum Accelerator {
+    EdgeTpu,
+    Cpu,
+}
+
+/// Something which runs the model.
+enum Backend {
+    /// An interpreter and the model data it was built from. Fields drop in order, so the data
+    /// outlives the interpreter.
+    Interpreter(moonfire_tflite::Interpreter<'static>, ModelData),
+
+    /// Takes the given time per invocation, one image at a time, and detects nothing.
+    Mock(Duration),
+}
+
+impl Backend {
+    /// Returns the size in bytes of one image of input, if known.
+    fn image_len(&self) -> Result<Option<usize>, BoxedError> {
+        let interpreter = match self {
+            Backend::Interpreter(i, _) => i,
+            Backend::Mock(_) => return Ok(None),
+        };
+        let inputs = interpreter.inputs();
+        if inputs.len() != 1 {
+            return Err(format!("expected model to have 1 input; has {}", inputs.len()).into());
+        }
+        Ok(Some(inputs[0].byte_size() / inputs[0].dim(0)))
+    }
+
+    fn batch_size(&self) -> usize {
+        match self {
+            Backend::Interpreter(i, _) => i.inputs()[0].dim(0),
+            Backend::Mock(_) => 1,
+        }
+    }
+
+    fn detect<'i>(&mut self, image_len: usize, images: impl Iterator<Item = &'i [u8]>)
+                  -> Result<Vec<proto::ImageResult>, tonic::Status> {
+        match self {
+            Backend::Interpreter(i, _) => detect(i, image_len, images),
+            Backend::Mock(d) => {
+                std::thread::sleep(*d);
+                Ok(images.map(|_| proto::ImageResult {
+                    model_result: Some(proto::image_result::ModelResult::ObjectDetectionResult(
+                        proto::ObjectDetectionResult::default())),
+                }).collect())
+            },
+        }
+    }
+}
+
+/// A model's definition, before its interpreters are built.
+struct ModelDef {
     model: proto::Model,
+
+    /// TensorFlow Lite flatbuffers; either may be empty.
+    edgetpu_model: ModelData,
+    cpu_model: ModelData,
+
+    /// A hash of the source data, to tell if the model has changed on reload.
+    hash: u64,
 }
 
-impl MyInferencer {
-    fn new(delegate: Option<&'static moonfire_tflite::Delegate>)
-           -> Result<Self, BoxedError> {
-        let m = moonfire_tflite::Model::from_static(nvr_analytics::MODEL).unwrap();
-        let mut builder = moonfire_tflite::Interpreter::builder();
-        if let Some(d) = delegate {
+fn hash(data: &[u8]) -> u64 {
+    use std::hash::{Hash, Hasher};
+    let mut h = std::collections::hash_map::DefaultHasher::new();
+    data.hash(&mut h);
+    h.finish()
+}
+
+/// Returns the built-in model, served when neither `--model-dir` nor `--db` is given.
+fn builtin_def(opt: &Opt) -> Result<ModelDef, BoxedError> {
+    let mut model = proto::Model::default();
+    model.uuid = "4d1c73aa-b6ef-4986-a01d-3abe94693c4c".to_owned();
+    model.name = "MobileNet SSD v2 (COCO)".to_owned();
+    model.r#type = proto::ModelType::ModelObjectDetection as i32;
+    model.active = true;
+    model.input_parameters = Some(proto::ImageParameters {
+        pixel_format: proto::PixelFormat::Rgb24 as i32,
+        width: 300,
+        height: 300,
+    });
+    model.labels = HashMap::new();
+    for (i, l) in nvr_analytics::LABELS.iter().enumerate() {
+        if let Some(l) = l {
+            model.labels.insert(u32::try_from(i).unwrap(), l.to_string());
+        }
+    }
+    let cpu_model = match opt.cpu_model.as_ref() {
+        None if opt.cpu_interpreters > 0 => {
+            return Err("--cpu-interpreters requires --cpu-model".into());
+        },
+        None => Vec::new(),
+        Some(p) => std::fs::read(p)?,
+    };
+    Ok(ModelDef {
+        model,
+        edgetpu_model: Arc::new(Cow::Borrowed(nvr_analytics::MODEL)),
+        hash: hash(&cpu_model),
+        cpu_model: Arc::new(Cow::Owned(cpu_model)),
+    })
+}
+
+/// Parses a model from a serialized `ModelData` message.
+fn parse_def(uuid: String, name: Option<String>, data: Vec<u8>) -> Result<ModelDef, BoxedError> {
+    let d = proto::ModelData::decode(&data[..])?;
+    if d.edgetpu_model.is_empty() && d.cpu_model.is_empty() {
+        return Err(format!("model {} has neither an Edge TPU nor a CPU version", uuid).into());
+    }
+    Ok(ModelDef {
+        model: proto::Model {
+            uuid,
+            name: name.unwrap_or(d.name),
+            r#type: d.r#type,
+            active: true,
+            input_parameters: d.input_parameters,
+            labels: d.labels,
+        },
+        edgetpu_model: Arc::new(Cow::Owned(d.edgetpu_model)),
+        cpu_model: Arc::new(Cow::Owned(d.cpu_model)),
+        hash: hash(&data),
+    })
+}
+
+/// Loads all configured models' definitions.
+fn load_defs(opt: &Opt) -> Result<Vec<ModelDef>, BoxedError> {
+    if opt.model_dir.is_none() && opt.db.is_none() {
+        return Ok(vec![builtin_def(opt)?]);
+    }
+    let mut defs = Vec::new();
+    if let Some(dir) = opt.model_dir.as_ref() {
+        for e in std::fs::read_dir(dir)? {
+            let path = e?.path();
+            if path.extension() != Some(std::ffi::OsStr::new("model")) {
+                continue;
+            }
+            let stem = path.file_stem().unwrap().to_str()
+                .ok_or_else(|| format!("bad model filename {}", path.display()))?;
+            let uuid = uuid::Uuid::parse_str(stem)
+                .map_err(|e| format!("bad model filename {}: {}", path.display(), e))?;
+            defs.push(parse_def(uuid.to_hyphenated().to_string(), None, std::fs::read(&path)?)?);
+        }
+    }
+    if let Some(db) = opt.db.as_ref() {
+        let conn = rusqlite::Connection::open_with_flags(
+            db, rusqlite::OpenFlags::SQLITE_OPEN_READ_ONLY)?;
+        let mut stmt = conn.prepare(r#"
+            select uuid, name, data from object_detection_model where data is not null
+        "#)?;
+        let mut rows = stmt.query(rusqlite::NO_PARAMS)?;
+        while let Some(row) = rows.next()? {
+            let uuid: Vec<u8> = row.get(0)?;
+            let uuid = uuid::Uuid::from_slice(&uuid)?.to_hyphenated().to_string();
+            defs.push(parse_def(uuid, Some(row.get(1)?), row.get(2)?)?);
+        }
+    }
+    Ok(defs)
+}
+
+/// A TensorFlow Lite flatbuffer, shared by the interpreters built from it and freed after the
+/// last of them.
+type ModelData = Arc<Cow<'static, [u8]>>;
+
+/// Loads `data` as a model.
+///
+/// `Model::from_static` requires `'static` data. This is safe only if the returned model and
+/// every interpreter built from it are dropped before the last clone of `data`.
+unsafe fn load_model(data: &ModelData) -> Result<moonfire_tflite::Model, ()> {
+    let d: &'static [u8] = std::slice::from_raw_parts(data.as_ptr(), data.len());
+    moonfire_tflite::Model::from_static(d)
+}
+
+/// A model and the interpreters running it.
+///
+/// Dropping the last reference stops the interpreters once their queue is empty. The
+/// inferencer's map of pools holds one reference, and each request holds another while in
+/// progress, so a reload which replaces a pool lets the old pool's requests finish first.
+struct Pool {
+    model: proto::Model,
+    scheduler: Arc<Scheduler>,
+    hash: u64,
+}
+
+impl Drop for Pool {
+    fn drop(&mut self) { self.scheduler.retire(); }
+}
+
+/// Builds interpreters for `def` and starts their dispatchers.
+fn build_pool(def: ModelDef, opt: &Opt, delegates: &'static [moonfire_tflite::edgetpu::Delegate])
+              -> Result<Pool, BoxedError> {
+    let model = def.model;
+    let mut backends = Vec::new();
+
+    // One interpreter per Edge TPU. Several models' interpreters can share a device, at the
+    // cost of swapping their parameters in and out of its memory.
+    if !def.edgetpu_model.is_empty() && !delegates.is_empty() {
+        // SAFETY: `m` is dropped at the end of this block and each interpreter is dropped
+        // before the clone of the data it holds.
+        let m = unsafe { load_model(&def.edgetpu_model) }
+            .map_err(|()| format!("unable to load Edge TPU model {}", model.uuid))?;
+        for d in delegates {
+            let mut builder = moonfire_tflite::Interpreter::builder();
             builder.add_borrowed_delegate(d);
+            let interpreter = builder.build(&m).map_err(|()| "unable to build interpreter")?;
+            backends.push((Accelerator::EdgeTpu,
+                           Backend::Interpreter(interpreter, def.edgetpu_model.clone())));
         }
-        let interpreter = builder.build(&m).unwrap();
+    }
+    if !def.cpu_model.is_empty() && opt.cpu_interpreters > 0 {
+        // SAFETY: as above.
+        let m = unsafe { load_model(&def.cpu_model) }
+            .map_err(|()| format!("unable to load CPU model {}", model.uuid))?;
+        for _ in 0..opt.cpu_interpreters {
+            let builder = moonfire_tflite::Interpreter::builder();
+            let interpreter = builder.build(&m).map_err(|()| "unable to build interpreter")?;
+            backends.push((Accelerator::Cpu,
+                           Backend::Interpreter(interpreter, def.cpu_model.clone())));
+        }
+    }
+    for _ in 0..opt.mock_interpreters {
+        let d = Duration::from_millis(opt.mock_invoke_ms);
+        backends.push((Accelerator::EdgeTpu, Backend::Mock(d)));
+    }
+    if backends.is_empty() {
+        return Err(format!("no interpreters for model {}: no edge tpu ready and no \
+                            --cpu-interpreters or --mock-interpreters", model.uuid).into());
+    }
+    info!("model {} ({}): running {} interpreters: {:?}", model.uuid, model.name,
+          backends.len(), backends.iter().map(|(a, b)| match b {
+              Backend::Mock(_) => "Mock".to_owned(),
+              Backend::Interpreter(..) => format!("{:?}", a),
+          }).collect::<Vec<_>>());
 
-        let mut model = proto::Model::default();
-        model.uuid = "4d1c73aa-b6ef-4986-a01d-3abe94693c4c".to_owned();
-        model.r#type = proto::ModelType::ModelObjectDetection as i32;
-        model.active = true;
-        model.input_parameters = Some(proto::ImageParameters {
-            pixel_format: proto::PixelFormat::Rgb24 as i32,
-            width: 300,
-            height: 300,
-        });
-        model.labels = HashMap::new();
-        for (i, l) in nvr_analytics::LABELS.iter().enumerate() {
-            if let Some(l) = l {
-                model.labels.insert(u32::try_from(i).unwrap(), l.to_string());
+    let input = model.input_parameters.as_ref()
+        .ok_or_else(|| format!("model {} has no input parameters", model.uuid))?;
+    if input.pixel_format != proto::PixelFormat::Rgb24 as i32 {
+        return Err(format!("model {} input isn't RGB24", model.uuid).into());
+    }
+    let image_len = 3 * input.width as usize * input.height as usize;
+    for (_, backend) in &backends {
+        if let Some(l) = backend.image_len()? {
+            if l != image_len {
+                return Err(format!("expected model {} input of {} bytes per image; got {}",
+                                   model.uuid, image_len, l).into());
             }
         }
+    }
+
+    let edgetpus = backends.iter().filter(|(a, _)| *a == Accelerator::EdgeTpu).count();
+    let scheduler = Arc::new(Scheduler::new(image_len, edgetpus));
+    for (i, (accelerator, backend)) in backends.into_iter().enumerate() {
+        // invoke blocks on the device, so each interpreter gets a dedicated thread rather
+        // than occupying a tokio worker.
+        let scheduler = scheduler.clone();
+        std::thread::Builder::new()
+            .name(format!("invoke-{}-{}", &model.uuid[..8], i))
+            .spawn(move || run_dispatcher(&scheduler, accelerator, backend))?;
+    }
+    Ok(Pool {
+        model,
+        scheduler,
+        hash: def.hash,
+    })
+}
+
+type Pools = Arc<parking_lot::RwLock<BTreeMap<String, Arc<Pool>>>>;
+
+#[derive(Clone)]
+struct MyInferencer {
+    opt: Arc<Opt>,
+
+    /// The pool serving each model, by uuid.
+    pools: Pools,
+
+    /// One delegate per Edge TPU, created at startup and shared by every pool's interpreters.
+    delegates: &'static [moonfire_tflite::edgetpu::Delegate],
+
+    /// The client, if this is serving a connection through the Unix domain socket.
+    local: Option<Arc<LocalClient>>,
+}
 
-        Ok(Self {
-            interpreter: Mutex::new(interpreter),
-            model,
+/// A client connected through the Unix domain socket. Dropped when its connection closes,
+/// unmapping its shared memory regions once requests in progress are done with them.
+struct LocalClient {
+    peer: nvr_analytics::transport::Peer,
+    regions: parking_lot::Mutex<Regions>,
+}
+
+/// Shared memory regions attached by a local client.
+#[derive(Default)]
+struct Regions {
+    next_id: u64,
+    by_id: HashMap<u64, Arc<nvr_analytics::transport::Mapping>>,
+}
+
+impl MyInferencer {
+    fn new(opt: Opt) -> Result<Self, BoxedError> {
+        // Interpreters borrow their delegates, and pools come and go on reload, so the
+        // delegates live for the rest of the process.
+        let delegates = moonfire_tflite::edgetpu::Devices::list()
+            .into_iter()
+            .map(|d| d.create_delegate())
+            .collect::<Result<Vec<_>, ()>>()
+            .map_err(|()| "unable to create delegate")?;
+        let inferencer = MyInferencer {
+            opt: Arc::new(opt),
+            pools: Arc::new(parking_lot::RwLock::new(BTreeMap::new())),
+            delegates: Box::leak(delegates.into_boxed_slice()),
+            local: None,
+        };
+        inferencer.reload()?;
+        if inferencer.pools.read().is_empty() {
+            return Err("no models".into());
+        }
+        tokio::spawn(run_stats_logger(inferencer.pools.clone()));
+        Ok(inferencer)
+    }
+
+    /// Returns an inferencer for a connection through the Unix domain socket from `peer`.
+    fn for_local(&self, peer: nvr_analytics::transport::Peer) -> Self {
+        MyInferencer {
+            local: Some(Arc::new(LocalClient {
+                peer,
+                regions: parking_lot::Mutex::new(Regions::default()),
+            })),
+            ..self.clone()
+        }
+    }
+
+    /// Returns the local client, or an error if shared memory isn't available to this one.
+    fn local(&self) -> Result<&LocalClient, tonic::Status> {
+        self.local.as_deref().ok_or_else(|| {
+            tonic::Status::new(tonic::Code::PermissionDenied,
+                               "shared memory requires the Unix domain socket")
         })
     }
+
+    /// Loads the configured models, starting pools for new or changed ones and dropping those
+    /// which have gone away. On error, keeps the existing pools. Blocks.
+    fn reload(&self) -> Result<(), BoxedError> {
+        let defs = load_defs(&self.opt)?;
+        let mut pools = BTreeMap::new();
+        for def in defs {
+            let uuid = def.model.uuid.clone();
+            let old = self.pools.read().get(&uuid).cloned();
+            let pool = match old {
+                Some(p) if p.hash == def.hash => p,
+                old => {
+                    info!("{} model {} ({})", if old.is_some() { "reloading" } else { "loading" },
+                          uuid, def.model.name);
+                    Arc::new(build_pool(def, &self.opt, self.delegates)?)
+                },
+            };
+            if pools.insert(uuid.clone(), pool).is_some() {
+                return Err(format!("duplicate model {}", uuid).into());
+            }
+        }
+        for (uuid, p) in self.pools.read().iter() {
+            if !pools.contains_key(uuid) {
+                info!("unloading model {} ({})", uuid, p.model.name);
+            }
+        }
+        *self.pools.write() = pools;
+        Ok(())
+    }
+
+    /// Processes a single image, for `ProcessImage` or `ProcessImageStream`.
+    async fn process_one(&self, deadline: Option<Instant>, request: proto::ProcessImageRequest)
+                         -> Result<proto::ImageResult, tonic::Status> {
+        let pool = self.pool(&request.model_uuid)?;
+        let input = pool.model.input_parameters.as_ref().unwrap();
+        let (width, height) = (input.width, input.height);
+        let pixel_format = request.image_parameters.as_ref()
+            .map(|p| p.pixel_format)
+            .unwrap_or(proto::PixelFormat::Rgb24 as i32);
+        let resize_mode = proto::ResizeMode::from_i32(request.resize_mode)
+            .ok_or_else(|| tonic::Status::new(tonic::Code::InvalidArgument,
+                                              format!("unknown resize mode {}",
+                                                      request.resize_mode)))?;
+
+        let (image, placement) = match request.shared_image.as_ref() {
+            Some(s) if pixel_format == proto::PixelFormat::Rgb24 as i32 => {
+                (self.shared_image(s)?, None)
+            },
+            Some(_) => {
+                return Err(tonic::Status::new(tonic::Code::InvalidArgument,
+                                              "shared images must be RGB24"));
+            },
+            None => {
+                let (image, placement) = match proto::PixelFormat::from_i32(pixel_format) {
+                    Some(proto::PixelFormat::Rgb24) => (request.image, None),
+                    Some(proto::PixelFormat::Jpeg) => {
+                        decode_image(request.image, resize_mode, width, height).await?
+                    },
+                    Some(proto::PixelFormat::Yuv420p) => {
+                        let p = request.image_parameters.as_ref().unwrap();
+                        let file = y4m(p.width, p.height, &request.image[..])?;
+                        decode_image(file, resize_mode, width, height).await?
+                    },
+                    _ => return Err(tonic::Status::new(tonic::Code::InvalidArgument,
+                                                       format!("unsupported pixel format {}",
+                                                               pixel_format))),
+                };
+                (Image::Owned(image), placement)
+            },
+        };
+
+        let mut result = pool.scheduler.submit(request.priority, deadline, image).await?;
+        if let Some(p) = placement {
+            p.unplace(&mut result);
+        }
+        if let Some(f) = request.filter.as_ref() {
+            filter_result(f, &mut result);
+        }
+        Ok(result)
+    }
+
+    /// Returns the image in a shared memory slot.
+    fn shared_image(&self, s: &proto::SharedMemorySlot) -> Result<Image, tonic::Status> {
+        let m = self.local()?.regions.lock().by_id.get(&s.region_id).cloned().ok_or_else(|| {
+            tonic::Status::new(tonic::Code::NotFound,
+                               format!("no shared memory region {}", s.region_id))
+        })?;
+        if m.slot(s.slot).is_none() {
+            return Err(tonic::Status::new(tonic::Code::InvalidArgument,
+                                          format!("no slot {} in shared memory region {}",
+                                                  s.slot, s.region_id)));
+        }
+        Ok(Image::Shared(m, s.slot))
+    }
+
+    /// Returns the pool for `model_uuid`, checking that it can serve requests.
+    fn pool(&self, model_uuid: &str) -> Result<Arc<Pool>, tonic::Status> {
+        let pool = self.pools.read().get(model_uuid).cloned().ok_or_else(|| {
+            tonic::Status::new(tonic::Code::NotFound, format!("no model {}", model_uuid))
+        })?;
+        if pool.model.r#type != proto::ModelType::ModelObjectDetection as i32 {
+            return Err(tonic::Status::new(tonic::Code::Unimplemented,
+                                          format!("only object detection models are supported, \
+                                                   not {}", pool.model.r#type)));
+        }
+        Ok(pool)
+    }
 }
 
-/// Processes a single prescaled, raw image.
-fn process_image(interpreter: &mut moonfire_tflite::Interpreter, model: &proto::Model, image: &[u8])
-                 -> Result<proto::ImageResult, tonic::Status> {
-    if model.r#type != proto::ModelType::ModelObjectDetection as i32 {
-        return Err(tonic::Status::new(tonic::Code::Unimplemented, format!("only object detection models are supported, not {}", model.r#type)));
+/// A prescaled, raw image.
+enum Image {
+    Owned(Vec<u8>),
+
+    /// A slot of a client's shared memory region, holding at least the image's bytes.
+    Shared(Arc<nvr_analytics::transport::Mapping>, u32),
+}
+
+impl Image {
+    fn bytes(&self) -> &[u8] {
+        match self {
+            Image::Owned(v) => &v[..],
+            Image::Shared(m, slot) => m.slot(*slot).unwrap(),
+        }
     }
-    {
-        let mut inputs = interpreter.inputs();
-        if inputs.len() != 1 {
-            return Err(tonic::Status::new(tonic::Code::Internal,
-                                          format!("expected model to have 1 input; has {}",
-                                                  inputs.len())));
+}
+
+/// A request waiting in the `Scheduler` for an interpreter.
+struct Job {
+    priority: i32,
+    deadline: Option<Instant>,
+
+    /// The order of submission, to serve jobs of equal priority and deadline first-come,
+    /// first-served.
+    seq: u64,
+    enqueued: Instant,
+
+    image: Image,
+    reply: oneshot::Sender<Result<proto::ImageResult, tonic::Status>>,
+}
+
+impl Ord for Job {
+    /// Orders jobs so the next to run is the greatest, as `BinaryHeap` expects: highest
+    /// priority, then earliest deadline (jobs without one last), then first submitted.
+    fn cmp(&self, other: &Self) -> std::cmp::Ordering {
+        use std::cmp::Ordering;
+        self.priority.cmp(&other.priority)
+            .then_with(|| match (self.deadline, other.deadline) {
+                (Some(a), Some(b)) => b.cmp(&a),
+                (Some(_), None) => Ordering::Greater,
+                (None, Some(_)) => Ordering::Less,
+                (None, None) => Ordering::Equal,
+            })
+            .then_with(|| other.seq.cmp(&self.seq))
+    }
+}
+
+impl PartialOrd for Job {
+    fn partial_cmp(&self, other: &Self) -> Option<std::cmp::Ordering> { Some(self.cmp(other)) }
+}
+
+impl PartialEq for Job {
+    fn eq(&self, other: &Self) -> bool { self.seq == other.seq }
+}
+
+impl Eq for Job {}
+
+#[derive(Default)]
+struct Queue {
+    jobs: BinaryHeap<Job>,
+    next_seq: u64,
+
+    /// Moving averages of the time to run a batch on each kind of interpreter.
+    edgetpu_invoke: Option<Duration>,
+    cpu_invoke: Option<Duration>,
+
+    /// Set when no more jobs can be submitted, so dispatchers should exit once idle.
+    retired: bool,
+}
+
+/// Queues images for the interpreters by priority and deadline.
+///
+/// Clients analyzing live video should use a higher `priority` than bulk work like backfill so
+/// they don't wait behind it. Within a priority, requests with a (gRPC) deadline go first,
+/// earliest first, and requests whose deadline passes while queued fail without running.
+///
+/// When the model takes a batch of more than one image, a dispatcher runs as many queued
+/// requests at once as it can, but it never waits for more to arrive.
+///
+/// Each interpreter's dispatcher thread takes work whenever it's idle, so work goes to
+/// whichever is free. CPU interpreters are much slower than Edge TPUs, though, so a CPU
+/// dispatcher takes a job only if the Edge TPUs would take longer than it to get through the
+/// queue. That depends on the queue depth and the moving average batch times, so a CPU
+/// dispatcher which declined is woken to check again when jobs are added or a batch finishes.
+struct Scheduler {
+    queue: parking_lot::Mutex<Queue>,
+
+    /// Signaled when jobs are added, to wake idle dispatchers of each kind. `cpu_cv` is also
+    /// signaled when the batch times change, which may change whether a CPU dispatcher should
+    /// take the queued jobs.
+    edgetpu_cv: parking_lot::Condvar,
+    cpu_cv: parking_lot::Condvar,
+
+    /// The size in bytes of one image of a batch.
+    image_len: usize,
+
+    /// The number of Edge TPU interpreters.
+    edgetpus: usize,
+
+    /// Statistics by priority, since startup.
+    stats: parking_lot::Mutex<BTreeMap<i32, PriorityStats>>,
+}
+
+struct PriorityStats {
+    /// The time from submission until a dispatcher took each job it ran.
+    wait_times: Histogram,
+
+    /// The number of jobs failed because their deadline passed while queued.
+    expired: u64,
+}
+
+impl PriorityStats {
+    fn new() -> Self { PriorityStats { wait_times: Histogram::new(), expired: 0 } }
+}
+
+impl Scheduler {
+    fn new(image_len: usize, edgetpus: usize) -> Self {
+        Scheduler {
+            queue: parking_lot::Mutex::new(Queue::default()),
+            edgetpu_cv: parking_lot::Condvar::new(),
+            cpu_cv: parking_lot::Condvar::new(),
+            image_len,
+            edgetpus,
+            stats: parking_lot::Mutex::new(BTreeMap::new()),
         }
-        let input = &mut inputs[0];
-        if input.byte_size() != image.len() {
+    }
+
+    /// Runs object detection on a prescaled, raw image.
+    async fn submit(&self, priority: i32, deadline: Option<Instant>, image: Image)
+                    -> Result<proto::ImageResult, tonic::Status> {
+        let len = image.bytes().len();
+        let ok = match image {
+            Image::Owned(_) => len == self.image_len,
+            Image::Shared(..) => len >= self.image_len,
+        };
+        if !ok {
             return Err(tonic::Status::new(tonic::Code::InvalidArgument,
                                           format!("expected {}-byte input; got {}-byte input",
-                                                  input.byte_size(), image.len())));
+                                                  self.image_len, len)));
+        }
+        let (reply, reply_rx) = oneshot::channel();
+        {
+            let mut q = self.queue.lock();
+            let seq = q.next_seq;
+            q.next_seq += 1;
+            q.jobs.push(Job {
+                priority,
+                deadline,
+                seq,
+                enqueued: Instant::now(),
+                image,
+                reply,
+            });
+        }
+        self.wake();
+        reply_rx.await
+            .map_err(|_| tonic::Status::new(tonic::Code::Internal, "dispatcher dropped request"))?
+    }
+
+    /// Returns true if the job at the head of the queue would be done sooner on a CPU
+    /// interpreter than by waiting for the Edge TPUs.
+    fn cpu_should_take(&self, q: &Queue) -> bool {
+        match (self.edgetpus, q.edgetpu_invoke, q.cpu_invoke) {
+            (0, _, _) => true,
+            (e, Some(t), Some(c)) => t.mul_f64(q.jobs.len() as f64 / e as f64) > c,
+            _ => true,  // Try each kind to learn how fast it is.
+        }
+    }
+
+    /// Wakes one idle dispatcher of each kind.
+    fn wake(&self) {
+        self.edgetpu_cv.notify_one();
+        self.cpu_cv.notify_one();
+    }
+
+    /// Takes up to `n` jobs for an interpreter of the given kind, blocking until there's at
+    /// least one. Returns `None` once retired and drained.
+    fn take(&self, accelerator: Accelerator, n: usize) -> Option<Vec<Job>> {
+        let mut q = self.queue.lock();
+        loop {
+            let declined = accelerator == Accelerator::Cpu && !q.jobs.is_empty() &&
+                           !self.cpu_should_take(&q);
+            let n = if declined { 0 } else { n };
+            let now = Instant::now();
+            let mut jobs = Vec::with_capacity(n);
+            while jobs.len() < n {
+                let job = match q.jobs.pop() {
+                    None => break,
+                    Some(j) => j,
+                };
+                if job.reply.is_closed() {
+                    continue;  // The client went away.
+                }
+                let mut stats = self.stats.lock();
+                let stats = stats.entry(job.priority).or_insert_with(PriorityStats::new);
+                if job.deadline.map(|d| d <= now).unwrap_or(false) {
+                    stats.expired += 1;
+                    let _ = job.reply.send(Err(tonic::Status::new(
+                        tonic::Code::DeadlineExceeded, "deadline exceeded while queued")));
+                    continue;
+                }
+                stats.wait_times.record(now - job.enqueued);
+                jobs.push(job);
+            }
+            if !jobs.is_empty() {
+                if !q.jobs.is_empty() {
+                    self.wake();  // Let another dispatcher take the rest.
+                }
+                return Some(jobs);
+            }
+            if q.retired && q.jobs.is_empty() {
+                return None;
+            }
+            match accelerator {
+                Accelerator::Cpu => self.cpu_cv.wait(&mut q),
+                Accelerator::EdgeTpu => self.edgetpu_cv.wait(&mut q),
+            }
+        }
+    }
+
+    /// Stops dispatchers once the queue is empty. Nothing may submit afterward.
+    fn retire(&self) {
+        self.queue.lock().retired = true;
+        self.edgetpu_cv.notify_all();
+        self.cpu_cv.notify_all();
+    }
+
+    /// Notes that a batch took `d` to run on an interpreter of the given kind.
+    fn record_invoke(&self, accelerator: Accelerator, d: Duration) {
+        let mut q = self.queue.lock();
+        let avg = match accelerator {
+            Accelerator::EdgeTpu => &mut q.edgetpu_invoke,
+            Accelerator::Cpu => &mut q.cpu_invoke,
+        };
+        *avg = Some(match *avg {
+            None => d,
+            Some(a) => a.mul_f64(0.9) + d.mul_f64(0.1),
+        });
+
+        // A CPU dispatcher may have declined the queued jobs based on the old average.
+        if !q.jobs.is_empty() {
+            self.cpu_cv.notify_one();
+        }
+    }
+
+    fn log_stats(&self, model: &str) {
+        for (priority, s) in self.stats.lock().iter() {
+            let h = &s.wait_times;
+            info!("model {} priority {}: {} requests; queue wait mean {:?}, p50 {:?}, p99 {:?}, \
+                   max {:?}; {} expired while queued", model, priority, h.count(), h.mean(),
+                  h.quantile(0.5), h.quantile(0.99), h.max(), s.expired);
+        }
+        let q = self.queue.lock();
+        info!("model {} mean batch time: Edge TPU {:?}, CPU {:?}",
+              model, q.edgetpu_invoke, q.cpu_invoke);
+    }
+}
+
+/// Runs jobs from `scheduler` on `backend`, as many at once as its input's batch size, until
+/// the scheduler is retired. Results go back to the async side through each job's oneshot
+/// channel.
+fn run_dispatcher(scheduler: &Scheduler, accelerator: Accelerator, mut backend: Backend) {
+    let batch_size = backend.batch_size();
+    while let Some(jobs) = scheduler.take(accelerator, batch_size) {
+        let start = Instant::now();
+        let image_len = scheduler.image_len;
+        let r = backend.detect(image_len, jobs.iter().map(|j| &j.image.bytes()[..image_len]));
+        scheduler.record_invoke(accelerator, start.elapsed());
+        match r {
+            Ok(results) => {
+                for (j, r) in jobs.into_iter().zip(results.into_iter()) {
+                    let _ = j.reply.send(Ok(r));
+                }
+            },
+            Err(e) => {
+                for j in jobs {
+                    let _ = j.reply.send(Err(tonic::Status::new(e.code(), e.message())));
+                }
+            },
+        }
+    }
+}
+
+/// Logs each model's queue wait and batch times once a minute.
+async fn run_stats_logger(pools: Pools) {
+    let mut interval = tokio::time::interval(Duration::from_secs(60));
+    loop {
+        interval.tick().await;
+        let pools: Vec<_> = pools.read().values().cloned().collect();
+        for p in pools {
+            p.scheduler.log_stats(&p.model.uuid);
+        }
+    }
+}
+
+/// Returns the deadline the client set via the `grpc-timeout` header, if any.
+fn deadline(metadata: &tonic::metadata::MetadataMap) -> Option<Instant> {
+    let timeout = metadata.get("grpc-timeout")?.to_str().ok()?;
+    if timeout.len() < 2 {
+        return None;
+    }
+    let (n, unit) = timeout.split_at(timeout.len() - 1);
+    let n: u64 = n.parse().ok()?;
+    let d = match unit {
+        "H" => Duration::from_secs(n * 3600),
+        "M" => Duration::from_secs(n * 60),
+        "S" => Duration::from_secs(n),
+        "m" => Duration::from_millis(n),
+        "u" => Duration::from_micros(n),
+        "n" => Duration::from_nanos(n),
+        _ => return None,
+    };
+    Some(Instant::now() + d)
+}
+
+/// Runs object detection on prescaled, raw images of `image_len` bytes each, one per slot of
+/// the interpreter's input batch.
+fn detect<'i>(interpreter: &mut moonfire_tflite::Interpreter, image_len: usize,
+              images: impl Iterator<Item = &'i [u8]>)
+              -> Result<Vec<proto::ImageResult>, tonic::Status> {
+    let mut n = 0;
+    {
+        let mut inputs = interpreter.inputs();
+        for (slot, image) in inputs[0].bytes_mut().chunks_mut(image_len).zip(images) {
+            slot.copy_from_slice(image);
+            n += 1;
         }
-        input.bytes_mut().copy_from_slice(&image[..]);
     }
     interpreter.invoke()
         .map_err(|()| tonic::Status::new(tonic::Code::Unknown, "interpreter failed"))?;
@@ -79,36 +845,111 @@ fn process_image(interpreter: &mut moonfire_tflite::Interpreter, model: &proto::
                                       format!("expected model to have 4 outputs; has {}",
                                               outputs.len())));
     }
-    let boxes = outputs[0].f32s();
-    let labels = outputs[1].f32s();
-    let scores = outputs[2].f32s();
-    let mut r = proto::ObjectDetectionResult::default();
-    for (i, &score) in scores.iter().enumerate() {
-        if score <= 0. {
-            continue;
+
+    // Each output has a leading batch dimension.
+    let batch_size = outputs[2].dim(0);
+    let boxes = outputs[0].f32s().chunks(outputs[0].f32s().len() / batch_size);
+    let labels = outputs[1].f32s().chunks(outputs[1].f32s().len() / batch_size);
+    let scores = outputs[2].f32s().chunks(outputs[2].f32s().len() / batch_size);
+    Ok(boxes.zip(labels).zip(scores).take(n).map(|((boxes, labels), scores)| {
+        let mut r = proto::ObjectDetectionResult::default();
+        for (i, &score) in scores.iter().enumerate() {
+            if score <= 0. {
+                continue;
+            }
+            let label = labels[i];
+            if !(0. <= label && label <= u32::max_value() as f32) {
+                continue;
+            }
+            let y = boxes[4*i + 0];
+            let x = boxes[4*i + 1];
+            let h = boxes[4*i + 2] - y;
+            let w = boxes[4*i + 3] - x;
+            r.x.push(x);
+            r.y.push(y);
+            r.h.push(h);
+            r.w.push(w);
+            r.score.push(scores[i]);
+            r.label.push(label as u32);
         }
-        let label = labels[i];
-        if !(0. <= label && label <= u32::max_value() as f32) {
-            continue;
+        proto::ImageResult {
+            model_result: Some(proto::image_result::ModelResult::ObjectDetectionResult(r)),
         }
-        let y = boxes[4*i + 0];
-        let x = boxes[4*i + 1];
-        let h = boxes[4*i + 2] - y;
-        let w = boxes[4*i + 3] - x;
-        r.x.push(x);
-        r.y.push(y);
-        r.h.push(h);
-        r.w.push(w);
-        r.score.push(scores[i]);
-        r.label.push(label as u32);
-    }
-    Ok(proto::ImageResult {
-        model_result: Some(proto::image_result::ModelResult::ObjectDetectionResult(r)),
-    })
+    }).collect())
+}
+
+/// Applies `filter` to `result`, which must be from `detect`.
+fn filter_result(filter: &proto::DetectionFilter, result: &mut proto::ImageResult) {
+    let r = match result.model_result.as_mut() {
+        Some(proto::image_result::ModelResult::ObjectDetectionResult(r)) => r,
+        _ => return,
+    };
+    let mut keep: Vec<usize> = (0..r.score.len())
+        .filter(|&i| r.score[i] >= filter.min_score &&
+                     (filter.label.is_empty() || filter.label.contains(&r.label[i])))
+        .collect();
+    if filter.nms_iou_threshold > 0. {
+        keep = suppress(r, keep, filter.nms_iou_threshold);
+    }
+    let old = std::mem::take(r);
+    r.label = keep.iter().map(|&i| old.label[i]).collect();
+    if filter.quantize {
+        r.quantized_box.reserve(4 * keep.len());
+        for &i in &keep {
+            r.quantized_box.extend_from_slice(&[quantize(old.x[i]), quantize(old.w[i]),
+                                                quantize(old.y[i]), quantize(old.h[i])]);
+        }
+        r.quantized_score = keep.iter().map(|&i| quantize(old.score[i])).collect();
+    } else {
+        r.x = keep.iter().map(|&i| old.x[i]).collect();
+        r.y = keep.iter().map(|&i| old.y[i]).collect();
+        r.w = keep.iter().map(|&i| old.w[i]).collect();
+        r.h = keep.iter().map(|&i| old.h[i]).collect();
+        r.score = keep.iter().map(|&i| old.score[i]).collect();
+    }
+}
+
+/// Non-maximum suppression: returns the subset of `candidates` (indices into `r`) not
+/// overlapping a higher-scoring detection of the same label by IoU above `threshold`, in
+/// their original order.
+fn suppress(r: &proto::ObjectDetectionResult, mut candidates: Vec<usize>, threshold: f32)
+            -> Vec<usize> {
+    candidates.sort_by(|&a, &b| r.score[b].partial_cmp(&r.score[a])
+                                          .unwrap_or(std::cmp::Ordering::Equal));
+    let mut kept: Vec<usize> = Vec::with_capacity(candidates.len());
+    for i in candidates {
+        if kept.iter().all(|&j| r.label[j] != r.label[i] || iou(r, i, j) <= threshold) {
+            kept.push(i);
+        }
+    }
+    kept.sort();
+    kept
+}
+
+/// Returns the intersection over union of detections `i` and `j` in `r`.
+fn iou(r: &proto::ObjectDetectionResult, i: usize, j: usize) -> f32 {
+    let overlap = |a: f32, a_len: f32, b: f32, b_len: f32| {
+        ((a + a_len).min(b + b_len) - a.max(b)).max(0.)
+    };
+    let intersection = overlap(r.x[i], r.w[i], r.x[j], r.w[j]) *
+                       overlap(r.y[i], r.h[i], r.y[j], r.h[j]);
+    let union = r.w[i] * r.h[i] + r.w[j] * r.h[j] - intersection;
+    if union > 0. { intersection / union } else { 0. }
+}
+
+/// Converts `v` to a fixed 8-bit number, as in backfill's `frame_data`.
+fn quantize(v: f32) -> u8 {
+    (v.max(0.).min(1.0) * 255.) as u8
 }
 
+/// The most images of a single `ProcessImageStream` call to have in flight at once.
+const MAX_STREAM_IN_FLIGHT: usize = 64;
+
 #[tonic::async_trait]
 impl Inferencer for MyInferencer {
+    type ProcessImageStreamStream = std::pin::Pin<Box<
+        dyn futures::Stream<Item = Result<proto::ProcessImageStreamResponse, tonic::Status>> +
+                            Send + Sync>>;
     type ProcessVideoStream = std::pin::Pin<Box<
         dyn futures::Stream<Item = Result<proto::ProcessVideoResponse, tonic::Status>> +
                             Send + Sync>>;
@@ -118,58 +959,498 @@ impl Inferencer for MyInferencer {
         _request: tonic::Request<proto::ListModelsRequest>,
     ) -> Result<tonic::Response<proto::ListModelsResponse>, tonic::Status> {
         let resp = proto::ListModelsResponse {
-            model: vec![self.model.clone()],
+            model: self.pools.read().values().map(|p| p.model.clone()).collect(),
         };
         Ok(tonic::Response::new(resp))
     }
 
-    async fn process_image(
+    async fn attach_shared_memory(
         &self,
-        request: tonic::Request<proto::ProcessImageRequest>,
-    ) -> Result<tonic::Response<proto::ProcessImageResponse>, tonic::Status> {
+        request: tonic::Request<proto::AttachSharedMemoryRequest>,
+    ) -> Result<tonic::Response<proto::AttachSharedMemoryResponse>, tonic::Status> {
+        let local = self.local()?;
         let request = request.into_inner();
-        if request.model_uuid != self.model.uuid {
-            return Err(tonic::Status::new(tonic::Code::FailedPrecondition,
-                                          format!("active model is {}, not {}",
-                                                  &self.model.uuid, &request.model_uuid)));
+        let slot_len = usize::try_from(request.slot_len).unwrap();
+        let peer = local.peer;
+        let mapping = tokio::task::spawn_blocking(move || {
+            nvr_analytics::transport::Mapping::open(peer, request.fd, slot_len, request.slots)
+        }).await.unwrap()
+            .map_err(|e| tonic::Status::new(tonic::Code::InvalidArgument, e.to_string()))?;
+        let mut regions = local.regions.lock();
+        let region_id = regions.next_id;
+        regions.next_id += 1;
+        regions.by_id.insert(region_id, Arc::new(mapping));
+        Ok(tonic::Response::new(proto::AttachSharedMemoryResponse { region_id }))
+    }
+
+    async fn detach_shared_memory(
+        &self,
+        request: tonic::Request<proto::DetachSharedMemoryRequest>,
+    ) -> Result<tonic::Response<proto::DetachSharedMemoryResponse>, tonic::Status> {
+        // Requests in progress hold their own reference to the mapping.
+        let region_id = request.into_inner().region_id;
+        if self.local()?.regions.lock().by_id.remove(&region_id).is_none() {
+            return Err(tonic::Status::new(tonic::Code::NotFound,
+                                          format!("no shared memory region {}", region_id)));
         }
+        Ok(tonic::Response::new(proto::DetachSharedMemoryResponse {}))
+    }
 
-        let mut interpreter = self.interpreter.lock().await;
-        let result = process_image(&mut interpreter, &self.model, &request.image[..])?;
+    async fn process_image(
+        &self,
+        request: tonic::Request<proto::ProcessImageRequest>,
+    ) -> Result<tonic::Response<proto::ProcessImageResponse>, tonic::Status> {
+        let deadline = deadline(request.metadata());
+        let result = self.process_one(deadline, request.into_inner()).await?;
         Ok(tonic::Response::new(proto::ProcessImageResponse {
             result: Some(result),
         }))
     }
 
+    async fn process_image_stream(
+        &self,
+        request: tonic::Request<tonic::Streaming<proto::ProcessImageStreamRequest>>,
+    ) -> Result<tonic::Response<Self::ProcessImageStreamStream>, tonic::Status> {
+        // The call's deadline applies to each image; images still queued when it passes are
+        // dropped just as in ProcessImage.
+        let deadline = deadline(request.metadata());
+        let request = request.into_inner();
+        let this = self.clone();
+        let (mut resp_tx, resp_rx) = futures::channel::mpsc::channel(MAX_STREAM_IN_FLIGHT);
+        tokio::spawn(async move {
+            let responses = request.map(move |r| {
+                let this = this.clone();
+                async move {
+                    let r = r?;
+                    let result = match r.request {
+                        None => Err(tonic::Status::new(tonic::Code::InvalidArgument,
+                                                       "missing request")),
+                        Some(req) => this.process_one(deadline, req).await,
+                    };
+                    Ok(match result {
+                        Ok(result) => proto::ProcessImageStreamResponse {
+                            sequence_number: r.sequence_number,
+                            response: Some(proto::ProcessImageResponse {
+                                result: Some(result),
+                            }),
+                            ..Default::default()
+                        },
+                        Err(e) => proto::ProcessImageStreamResponse {
+                            sequence_number: r.sequence_number,
+                            error_code: e.code() as i32,
+                            error_message: e.message().to_owned(),
+                            ..Default::default()
+                        },
+                    })
+                }
+            }).buffer_unordered(MAX_STREAM_IN_FLIGHT);
+            futures::pin_mut!(responses);
+            while let Some(r) = responses.next().await {
+                let stop = r.is_err();  // the request stream failed.
+                if resp_tx.send(r).await.is_err() || stop {
+                    break;
+                }
+            }
+        });
+        Ok(tonic::Response::new(Box::pin(resp_rx)))
+    }
+
     async fn process_video(
         &self,
-        _request: tonic::Request<tonic::Streaming<proto::ProcessVideoRequest>>,
+        request: tonic::Request<tonic::Streaming<proto::ProcessVideoRequest>>,
     ) -> Result<tonic::Response<Self::ProcessVideoStream>, tonic::Status> {
-        /*let mut ctx = None;
-        while let Some(msg) = request.message().await? {
-            ctx = Some(moonfire_ffmpeg::avformat::InputFormatContext
-        }*/
-        Err(tonic::Status::new(tonic::Code::Unimplemented, "process_video unimplemented"))
+        let mut request = request.into_inner();
+        let first = request.message().await?
+            .ok_or_else(|| tonic::Status::new(tonic::Code::InvalidArgument, "no requests"))?;
+        let pool = self.pool(&first.model_uuid)?;
+        let config = nvr_analytics::h264::parse_init_segment(&first.init_segment[..])
+            .map_err(|e| tonic::Status::new(tonic::Code::InvalidArgument,
+                                            format!("bad init segment: {}", e)))?;
+        let frame_interval = std::cmp::max(first.frame_interval, 1);
+        let priority = first.priority;
+        let filter = first.filter.clone();
+
+        // As in nvr_analytics::streaming, feed ffmpeg through a socket pair: a task writes the
+        // packets, converted to Annex B, to one end, and a blocking thread demuxes, decodes,
+        // and detects from the other.
+        let (reader, writer) = std::os::unix::net::UnixStream::pair()
+            .and_then(|(r, w)| { w.set_nonblocking(true)?; Ok((r, w)) })
+            .and_then(|(r, w)| Ok((r, tokio::net::UnixStream::from_std(w)?)))
+            .map_err(|e| tonic::Status::new(tonic::Code::Internal, e.to_string()))?;
+        let (resp_tx, resp_rx) = futures::channel::mpsc::channel(1);
+        tokio::spawn(feed_video(request, first, config, writer, resp_tx.clone()));
+        tokio::task::spawn_blocking(move || {
+            let mut resp_tx = resp_tx;
+            if let Err(e) = decode_video(reader, frame_interval, priority, filter.as_ref(),
+                                         &pool.scheduler, &pool.model, &mut resp_tx) {
+                let _ = futures::executor::block_on(resp_tx.send(Err(e)));
+            }
+        });
+        Ok(tonic::Response::new(Box::pin(resp_rx)))
+    }
+}
+
+/// Wraps a raw YUV420P image in a single-frame YUV4MPEG2 stream, a format ffmpeg can probe.
+fn y4m(width: u32, height: u32, data: &[u8]) -> Result<Vec<u8>, tonic::Status> {
+    let (w, h) = (width as usize, height as usize);
+    let expected = w * h + 2 * ((w + 1) / 2) * ((h + 1) / 2);
+    if w == 0 || h == 0 || data.len() != expected {
+        return Err(tonic::Status::new(tonic::Code::InvalidArgument,
+                                      format!("expected {}-byte {}x{} YUV420P image; got {} bytes",
+                                              expected, width, height, data.len())));
+    }
+    let mut out = format!("YUV4MPEG2 W{} H{} F1:1 Ip A1:1 C420jpeg\nFRAME\n", width, height)
+        .into_bytes();
+    out.extend_from_slice(data);
+    Ok(out)
+}
+
+/// Where a scaled image was placed within the model's input.
+struct Placement {
+    /// The offset of the scaled image's top-left corner within the input. Negative when
+    /// cropping.
+    x: i64,
+    y: i64,
+
+    /// The scaled image's size.
+    w: i64,
+    h: i64,
+
+    /// The input's size.
+    input_w: i64,
+    input_h: i64,
+}
+
+impl Placement {
+    fn new(mode: proto::ResizeMode, src_w: i64, src_h: i64, input_w: i64, input_h: i64) -> Self {
+        // Compare aspect ratios: is the source wider than the input?
+        let wider = src_w * input_h > src_h * input_w;
+        let (w, h) = match (mode, wider) {
+            (proto::ResizeMode::Stretch, _) => (input_w, input_h),
+            (proto::ResizeMode::Letterbox, true) | (proto::ResizeMode::Crop, false) => {
+                (input_w, std::cmp::max(1, src_h * input_w / src_w))
+            },
+            (proto::ResizeMode::Letterbox, false) | (proto::ResizeMode::Crop, true) => {
+                (std::cmp::max(1, src_w * input_h / src_h), input_h)
+            },
+        };
+        Placement {
+            x: (input_w - w) / 2,
+            y: (input_h - h) / 2,
+            w,
+            h,
+            input_w,
+            input_h,
+        }
+    }
+
+    /// Copies `from`, a RGB24 frame of the scaled size, into the packed input buffer `to`.
+    /// Leaves letterboxed areas untouched.
+    fn copy(&self, from: &VideoFrame, to: &mut [u8]) {
+        let from = from.plane(0);
+        let x0 = std::cmp::max(self.x, 0);
+        let x1 = std::cmp::min(self.x + self.w, self.input_w);
+        let row_len = 3 * (x1 - x0) as usize;
+        for to_y in std::cmp::max(self.y, 0) .. std::cmp::min(self.y + self.h, self.input_h) {
+            let from_i = (to_y - self.y) as usize * from.linesize + 3 * (x0 - self.x) as usize;
+            let to_i = 3 * (to_y * self.input_w + x0) as usize;
+            to[to_i..to_i+row_len].copy_from_slice(&from.data[from_i..from_i+row_len]);
+        }
+    }
+
+    /// Maps detections from input coordinates back to the original image's.
+    fn unplace(&self, r: &mut proto::ImageResult) {
+        let r = match r.model_result.as_mut() {
+            Some(proto::image_result::ModelResult::ObjectDetectionResult(r)) => r,
+            _ => return,
+        };
+        let (sx, sy) = (self.input_w as f32 / self.w as f32, self.input_h as f32 / self.h as f32);
+        let (ox, oy) = (self.x as f32 / self.input_w as f32, self.y as f32 / self.input_h as f32);
+        for x in &mut r.x { *x = (*x - ox) * sx; }
+        for y in &mut r.y { *y = (*y - oy) * sy; }
+        for w in &mut r.w { *w *= sx; }
+        for h in &mut r.h { *h *= sy; }
+    }
+}
+
+/// Decodes an image file on a blocking thread, returning a packed RGB24 buffer of the given
+/// size and where the image was placed within it.
+async fn decode_image(file: Vec<u8>, mode: proto::ResizeMode, width: u32, height: u32)
+                      -> Result<(Vec<u8>, Option<Placement>), tonic::Status> {
+    let body = StreamingBody::from_bytes(file)
+        .map_err(|e| tonic::Status::new(tonic::Code::Internal, e.to_string()))?;
+    let (image, placement) = tokio::task::spawn_blocking(move || {
+        decode_image_blocking(body, mode, width, height)
+    }).await.map_err(|e| tonic::Status::new(tonic::Code::Internal, e.to_string()))??;
+    Ok((image, Some(placement)))
+}
+
+/// Decodes the first frame of an image file and scales it into a packed RGB24 buffer of the
+/// given size.
+fn decode_image_blocking(body: StreamingBody, mode: proto::ResizeMode, width: u32, height: u32)
+                         -> Result<(Vec<u8>, Placement), tonic::Status> {
+    fn bad_image(e: impl std::fmt::Display) -> tonic::Status {
+        tonic::Status::new(tonic::Code::InvalidArgument, format!("bad image: {}", e))
+    }
+    let mut open_options = moonfire_ffmpeg::avutil::Dictionary::new();
+    let mut input = moonfire_ffmpeg::avformat::InputFormatContext::open(
+        &body.url(), &mut open_options).map_err(bad_image)?;
+    let stream = input.streams().get(0);
+    let par = stream.codecpar();
+    let mut dopt = moonfire_ffmpeg::avutil::Dictionary::new();
+    dopt.set(cstr!("threads"), cstr!("1")).unwrap();  // Output the frame without delay.
+    let d = par.new_decoder(&mut dopt).map_err(bad_image)?;
+    let mut f = VideoFrame::empty().unwrap();
+    loop {
+        let pkt = match input.read_frame() {
+            Ok(p) => p,
+            Err(e) if e.is_eof() => return Err(bad_image("no frames")),
+            Err(e) => return Err(bad_image(e)),
+        };
+        if d.decode_video(&pkt, &mut f).map_err(bad_image)? {
+            break;
+        }
+    }
+
+    let src = f.dims();
+    let placement = Placement::new(mode, i64::from(src.width), i64::from(src.height),
+                                   i64::from(width), i64::from(height));
+    let mut scaled = VideoFrame::owned(moonfire_ffmpeg::avutil::ImageDimensions {
+        width: i32::try_from(placement.w).unwrap(),
+        height: i32::try_from(placement.h).unwrap(),
+        pix_fmt: moonfire_ffmpeg::avutil::PixelFormat::rgb24(),
+    }).unwrap();
+    let mut s = moonfire_ffmpeg::swscale::Scaler::new(src, scaled.dims()).map_err(bad_image)?;
+    s.scale(&f, &mut scaled);
+    let mut image = vec![0; 3 * width as usize * height as usize];
+    placement.copy(&scaled, &mut image[..]);
+    Ok((image, placement))
+}
+
+type VideoResponseSender =
+    futures::channel::mpsc::Sender<Result<proto::ProcessVideoResponse, tonic::Status>>;
+
+/// Writes the packets of `first` and the rest of `request` to `writer` in Annex B form.
+/// Closes `writer` at the end of the request stream, or on error after reporting it.
+async fn feed_video(mut request: tonic::Streaming<proto::ProcessVideoRequest>,
+                    first: proto::ProcessVideoRequest, config: nvr_analytics::h264::AvcConfig,
+                    mut writer: tokio::net::UnixStream, mut resp_tx: VideoResponseSender) {
+    let r = async {
+        let mut buf = config.parameter_sets().to_vec();
+        let mut msg = Some(first);
+        loop {
+            let m = match msg.take() {
+                Some(m) => m,
+                None => match request.message().await? {
+                    Some(m) => m,
+                    None => break,
+                },
+            };
+            for p in &m.packet {
+                config.append_annex_b(&p[..], &mut buf).map_err(|e| {
+                    tonic::Status::new(tonic::Code::InvalidArgument, format!("bad packet: {}", e))
+                })?;
+            }
+
+            // If the decoder has stopped (because of an error or the client going away), this
+            // fails; it will have reported that already.
+            if writer.write_all(&buf[..]).await.is_err() {
+                break;
+            }
+            buf.clear();
+        }
+        Ok::<_, tonic::Status>(())
+    }.await;
+    drop(writer);
+    if let Err(e) = r {
+        warn!("process_video: {}", e);
+        let _ = resp_tx.send(Err(e)).await;
+    }
+}
+
+/// Decodes the Annex B stream from `reader`, sending detections on every `frame_interval`th
+/// frame to `resp_tx`. Blocks, so must be run on a dedicated thread.
+fn decode_video(reader: std::os::unix::net::UnixStream, frame_interval: u32, priority: i32,
+                filter: Option<&proto::DetectionFilter>, scheduler: &Scheduler,
+                model: &proto::Model, resp_tx: &mut VideoResponseSender)
+                -> Result<(), tonic::Status> {
+    fn bad_video(e: impl std::fmt::Display) -> tonic::Status {
+        tonic::Status::new(tonic::Code::InvalidArgument, format!("bad video: {}", e))
+    }
+    let url = std::ffi::CString::new(format!("pipe:{}", reader.as_raw_fd())).unwrap();
+    let mut open_options = moonfire_ffmpeg::avutil::Dictionary::new();
+    let mut input = moonfire_ffmpeg::avformat::InputFormatContext::open(&url, &mut open_options)
+        .map_err(bad_video)?;
+    const VIDEO_STREAM: usize = 0;
+    let stream = input.streams().get(VIDEO_STREAM);
+    let par = stream.codecpar();
+    let mut dopt = moonfire_ffmpeg::avutil::Dictionary::new();
+    dopt.set(cstr!("refcounted_frames"), cstr!("0")).unwrap();
+
+    // Every frame must come out of the decoder by the end of the stream, but moonfire-ffmpeg has
+    // no way to drain it with an empty packet. So keep it from holding frames back: frame
+    // threading delays output by a frame per thread, and reordering (as for B-frames) by the
+    // stream's reorder depth. With both off, each packet's frame is output as it's decoded.
+    dopt.set(cstr!("threads"), cstr!("1")).unwrap();
+    dopt.set(cstr!("flags"), cstr!("low_delay")).unwrap();
+    let d = par.new_decoder(&mut dopt).map_err(bad_video)?;
+
+    let params = model.input_parameters.as_ref().unwrap();
+    let mut scaled = VideoFrame::owned(moonfire_ffmpeg::avutil::ImageDimensions {
+        width: i32::try_from(params.width).unwrap(),
+        height: i32::try_from(params.height).unwrap(),
+        pix_fmt: moonfire_ffmpeg::avutil::PixelFormat::rgb24(),
+    }).unwrap();
+    let mut f = VideoFrame::empty().unwrap();
+
+    // The input dimensions aren't known until the first frame is decoded.
+    let mut scaler = None;
+    let mut frame_index: u64 = 0;
+    let mut packets: u64 = 0;
+    loop {
+        let pkt = match input.read_frame() {
+            Ok(p) => p,
+            Err(e) if e.is_eof() => break,
+            Err(e) => return Err(bad_video(e)),
+        };
+        if pkt.stream_index() != VIDEO_STREAM {
+            continue;
+        }
+        packets += 1;
+        if !d.decode_video(&pkt, &mut f).map_err(bad_video)? {
+            continue;
+        }
+        let i = frame_index;
+        frame_index += 1;
+        if i % u64::from(frame_interval) != 0 {
+            continue;
+        }
+        if scaler.is_none() {
+            scaler = Some(moonfire_ffmpeg::swscale::Scaler::new(f.dims(), scaled.dims())
+                          .map_err(bad_video)?);
+        }
+        scaler.as_mut().unwrap().scale(&f, &mut scaled);
+        let image = nvr_analytics::to_vec(&scaled);
+        let mut result = futures::executor::block_on(
+            scheduler.submit(priority, None, Image::Owned(image)))?;
+        if let Some(f) = filter {
+            filter_result(f, &mut result);
+        }
+        let resp = proto::ProcessVideoResponse {
+            frame: vec![proto::process_video_response::Frame {
+                result: Some(result),
+                frame_index: i,
+            }],
+        };
+        if futures::executor::block_on(resp_tx.send(Ok(resp))).is_err() {
+            return Ok(());  // The client went away.
+        }
     }
+    if frame_index < packets {
+        // Undecodable packets (such as those before the first keyframe) produce no frame.
+        warn!("video decoder output {} frames for {} packets", frame_index, packets);
+    }
+    Ok(())
 }
 
 #[tokio::main]
 async fn main() -> Result<(), BoxedError> {
+    let mut h = nvr_analytics::init_logging();
+    let _a = h.async_scope();
+    let opt = Opt::from_args();
     let addr = "0.0.0.0:8085".parse()?;
+    let uds_path = opt.uds.clone();
 
-    let devices = moonfire_tflite::edgetpu::Devices::list();
-    let delegate = if devices.is_empty() {
-        None
-    } else {
-        Some(&*Box::leak(Box::new(devices[0].create_delegate().unwrap())))
-    };
-    let inferencer = MyInferencer::new(delegate)?;
+    let inferencer = MyInferencer::new(opt)?;
     moonfire_ffmpeg::Ffmpeg::new();
 
-    tonic::transport::Server::builder()
-        .add_service(InferencerServer::new(inferencer))
-        .serve(addr)
-        .await?;
+    let reloader = inferencer.clone();
+    let mut hangups = tokio::signal::unix::signal(tokio::signal::unix::SignalKind::hangup())?;
+    tokio::spawn(async move {
+        while hangups.recv().await.is_some() {
+            let r = reloader.clone();
+            match tokio::task::spawn_blocking(move || r.reload().map_err(|e| e.to_string())).await {
+                Ok(Ok(())) => info!("reloaded models"),
+                Ok(Err(e)) => warn!("unable to reload models; keeping existing ones: {}", e),
+                Err(e) => warn!("model reload panicked: {}", e),
+            }
+        }
+    });
+
+    let uds = async {
+        let path = match uds_path.as_ref() {
+            None => return Ok::<_, BoxedError>(()),
+            Some(p) => p,
+        };
+        let _ = std::fs::remove_file(path);  // from a previous run.
+        let listener = tokio::net::UnixListener::bind(path)?;
+
+        // Each connection gets its own service, so it knows its peer's credentials (for
+        // attaching shared memory) and drops the peer's regions when it closes.
+        loop {
+            let (stream, _) = listener.accept().await?;
+            let peer = match nvr_analytics::transport::Peer::of(&stream) {
+                Ok(p) => p,
+                Err(e) => {
+                    warn!("unable to get Unix domain socket peer's credentials: {}", e);
+                    continue;
+                },
+            };
+            let service = InferencerServer::new(inferencer.for_local(peer));
+            tokio::spawn(async move {
+                let conn = hyper::server::conn::Http::new()
+                    .http2_only(true)
+                    .serve_connection(stream, service);
+                if let Err(e) = conn.await {
+                    warn!("Unix domain socket connection from pid {}: {}", peer.pid, e);
+                }
+            });
+        }
+    };
+    let tcp = async {
+        tonic::transport::Server::builder()
+            .add_service(InferencerServer::new(inferencer.clone()))
+            .serve(addr)
+            .await?;
+        Ok::<_, BoxedError>(())
+    };
+    futures::try_join!(uds, tcp)?;
 
     Ok(())
 }
+
+#[cfg(test)]
+mod test {
+    use super::proto;
+
+    #[test]
+    fn filter() {
+        let mut result = proto::ImageResult {
+            model_result: Some(proto::image_result::ModelResult::ObjectDetectionResult(
+                proto::ObjectDetectionResult {
+                    x:     vec![0.1, 0.12, 0.1, 0.6, 0.1],
+                    y:     vec![0.1, 0.1,  0.1, 0.6, 0.1],
+                    w:     vec![0.2, 0.2,  0.2, 0.2, 0.2],
+                    h:     vec![0.2, 0.2,  0.2, 0.2, 0.2],
+                    score: vec![0.6, 0.9,  0.8, 0.7, 0.2],
+                    label: vec![0,   0,    1,   0,   0],
+                    ..Default::default()
+                })),
+        };
+        super::filter_result(&proto::DetectionFilter {
+            min_score: 0.5,
+            label: vec![0],
+            nms_iou_threshold: 0.5,
+            quantize: true,
+        }, &mut result);
+        let r = match result.model_result.unwrap() {
+            proto::image_result::ModelResult::ObjectDetectionResult(r) => r,
+        };
+
+        // #0 is suppressed by #1, #2 has the wrong label, and #4 scores too low.
+        assert_eq!(r.label, &[0, 0]);
+        assert!(r.score.is_empty());
+        assert_eq!(r.quantized_box, &[30, 51, 25, 51, 153, 51, 153, 51]);
+        assert_eq!(r.quantized_score, &[229, 178]);
+    }
+}
@@ -0,0 +1,68 @@
+//! Trains a zstd dictionary for `recording_object_detection.frame_data` from a random sample of
+//! existing rows and stores it in the `zstd_dictionary` table. Subsequent `backfill` runs use the
+//! newest dictionary by default.
+
+use failure::{Error, bail};
+use log::info;
+use rusqlite::params;
+use std::collections::HashMap;
+use std::convert::TryFrom;
+use structopt::StructOpt;
+
+#[derive(StructOpt)]
+struct Opt {
+    #[structopt(short, long, parse(from_os_str))]
+    db: std::path::PathBuf,
+
+    /// The number of rows to sample.
+    #[structopt(long, default_value="2000")]
+    samples: u32,
+
+    /// The maximum size of the dictionary, in bytes.
+    #[structopt(long, default_value="16384")]
+    max_size: usize,
+}
+
+fn main() -> Result<(), Error> {
+    let mut h = nvr_analytics::init_logging();
+    let _a = h.async_scope();
+    let opt = Opt::from_args();
+    let conn = nvr_analytics::db::open(&opt.db)?;
+
+    // The sampled rows may have been compressed with earlier dictionaries; train on the raw data.
+    let mut dicts: HashMap<i64, Vec<u8>> = HashMap::new();
+    let mut samples = Vec::with_capacity(usize::try_from(opt.samples).unwrap());
+    let mut stmt = conn.prepare(r#"
+        select
+          frame_data,
+          frame_data_dictionary_id
+        from
+          recording_object_detection
+        order by random()
+        limit ?
+    "#)?;
+    let mut rows = stmt.query(params![opt.samples])?;
+    while let Some(row) = rows.next()? {
+        let frame_data: Vec<u8> = row.get(0)?;
+        let dict_id: Option<i64> = row.get(1)?;
+        let dict = match dict_id {
+            None => None,
+            Some(id) => {
+                if !dicts.contains_key(&id) {
+                    dicts.insert(id, nvr_analytics::dictionary::load(&conn, id)?);
+                }
+                Some(&dicts[&id][..])
+            },
+        };
+        samples.push(nvr_analytics::dictionary::decompress(&frame_data, dict)?);
+    }
+    if samples.is_empty() {
+        bail!("no rows to sample; run backfill first");
+    }
+    let sample_bytes: usize = samples.iter().map(|s| s.len()).sum();
+    info!("Training on {} rows ({} bytes)", samples.len(), sample_bytes);
+    let dict = zstd::dict::from_samples(&samples, opt.max_size)?;
+    conn.execute("insert into zstd_dictionary (data) values (?)", params![&dict])?;
+    info!("Created dictionary {} ({} bytes)", conn.last_insert_rowid(), dict.len());
+    Ok(())
+}
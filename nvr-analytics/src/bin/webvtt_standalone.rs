@@ -1,146 +1,357 @@
 /// Writes a WebVTT metadata caption file representing all of the objects detected in the given
-/// .mp4 file. Each cue represents a single object for a single frame.
+/// .mp4 file. Each cue represents a single object for a single frame, or with `--coalesce-iou`
+/// for a run of frames.
+///
+/// With `--out-dir`, annotates any number of files as a batch, writing `<stem>.vtt` for each.
+/// Inputs are decoded in parallel on a rayon pool and share one pool of interpreters (one per
+/// Edge TPU plus any `--cpu-interpreters`), so the model is loaded once for all of them.
+///
+/// With `--detect-interval`, objects are tracked between detector runs (see
+/// `nvr_analytics::track`), lowering the accelerator load for the same output frame rate.
 
 use cstr::*;
-use moonfire_ffmpeg::avutil::{Rational, VideoFrame};
-use serde::Serialize;
+use failure::{Error, bail, format_err};
+use log::{error, info};
+use moonfire_ffmpeg::avutil::VideoFrame;
+use nvr_analytics::track::Tracker;
+use nvr_analytics::webvtt::{Object, Writer};
+use rayon::prelude::*;
 use std::convert::TryFrom;
-use std::env;
 use std::ffi::CString;
-use std::io::Write;
-
-#[derive(Serialize)]
-struct Object {
-    label: &'static str,
-    score: f32,
-    x: f32,
-    y: f32,
-    w: f32,
-    h: f32,
-}
+use structopt::StructOpt;
 
-struct Pts(i64, Rational);
-
-impl std::fmt::Display for Pts {
-    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
-        // https://www.w3.org/TR/webvtt1/#webvtt-timestamp
-        let seconds = self.0 as f64 * self.1.num as f64 / self.1.den as f64;
-        let minutes = (seconds / 60.).trunc();
-        let seconds = seconds % 60.;
-        let hours = (minutes / 60.).trunc();
-        let minutes = minutes % 60.;
-        write!(f, "{:02.0}:{:02.0}:{:06.3}", hours, minutes, seconds)
-    }
+#[derive(StructOpt)]
+struct Opt {
+    /// Reuse the previous detections for frames whose luma differs from the last analyzed
+    /// frame's by at most this much per pixel (averaged over each 16x16 block). 0 analyzes
+    /// every frame.
+    #[structopt(long, default_value = "0")]
+    motion_threshold: u8,
+
+    /// Merge an object's cues across frames while each frame has an object with the same label
+    /// whose box has at least this intersection over union with the cue's. Unset writes a cue
+    /// per object per frame.
+    #[structopt(long)]
+    coalesce_iou: Option<f32>,
+
+    /// Track objects, running the detector only on every this many frames (or sooner, once a
+    /// track's position becomes uncertain) and carrying boxes forward in between. Each cue then
+    /// has a `track` id. 1 tracks with detection on every frame.
+    #[structopt(long)]
+    detect_interval: Option<u32>,
+
+    /// The number of CPU interpreters to run, in addition to one per Edge TPU. Requires
+    /// `--cpu-model`.
+    #[structopt(long, default_value = "0")]
+    cpu_interpreters: usize,
+
+    /// A CPU version of the built-in model, which is compiled for the Edge TPU. It must have
+    /// the same inputs, outputs, and labels.
+    #[structopt(long, parse(from_os_str))]
+    cpu_model: Option<std::path::PathBuf>,
+
+    /// Write a `.vtt` file here for each input, named after the input without its extension.
+    /// Without this, there must be a single input, and its captions go to stdout.
+    #[structopt(long, parse(from_os_str))]
+    out_dir: Option<std::path::PathBuf>,
+
+    /// A file naming more inputs, one per line.
+    #[structopt(long, parse(from_os_str))]
+    input_list: Option<std::path::PathBuf>,
+
+    /// The number of inputs to decode at once. Defaults to the number of CPUs plus the number
+    /// of interpreters, as each decoder waits while its frame is being invoked.
+    #[structopt(long)]
+    jobs: Option<usize>,
+
+    /// The videos to analyze.
+    inputs: Vec<String>,
 }
 
-fn write_objs(mut stdout: &mut dyn Write, start: Pts, end: Pts, objs: &[Object])
-              -> std::io::Result<()> {
-    for o in objs {
-        write!(stdout, "{} --> {}\n", start, end)?;
-        serde_json::to_writer(&mut stdout, o)?;
-        write!(stdout, "\n\n")?;
-    }
-    if !objs.is_empty() {
-        stdout.flush()?;
-    }
-    Ok(())
+type Interpreter<'a> = moonfire_tflite::Interpreter<'a>;
+
+/// The minimum intersection over union for a detection to continue a track.
+const TRACK_MIN_IOU: f32 = 0.3;
+
+/// The number of detector runs a track can go unmatched before it's dropped.
+const TRACK_MAX_MISSES: u32 = 2;
+
+/// A pool of interpreters shared by all decoders. Each is taken to fill and invoke it, then
+/// returned.
+struct Pool<'a> {
+    idle_tx: crossbeam::channel::Sender<Interpreter<'a>>,
+    idle_rx: crossbeam::channel::Receiver<Interpreter<'a>>,
+    len: usize,
+    width: usize,
+    height: usize,
 }
 
-fn main() {
-    let m = moonfire_tflite::Model::from_static(nvr_analytics::MODEL).unwrap();
-    let delegate;
-    let mut builder = moonfire_tflite::Interpreter::builder();
-    let devices = moonfire_tflite::edgetpu::Devices::list();
-    if !devices.is_empty() {
-        delegate = devices[0].create_delegate().unwrap();
-        builder.add_borrowed_delegate(&delegate);
+impl<'a> Pool<'a> {
+    fn new(interpreters: Vec<Interpreter<'a>>) -> Result<Self, Error> {
+        let (width, height);
+        {
+            let inputs = interpreters[0].inputs();
+            let input = &inputs[0];
+            let num_dims = input.num_dims();
+            assert_eq!(num_dims, 4);
+            assert_eq!(input.dim(0), 1);
+            height = input.dim(1);
+            width = input.dim(2);
+            assert_eq!(input.dim(3), 3);
+        }
+        for i in &interpreters[1..] {
+            let inputs = i.inputs();
+            if inputs[0].dim(1) != height || inputs[0].dim(2) != width {
+                bail!("interpreters' input dimensions differ");
+            }
+        }
+        let len = interpreters.len();
+        let (idle_tx, idle_rx) = crossbeam::channel::bounded(len);
+        for i in interpreters {
+            idle_tx.try_send(i).unwrap();
+        }
+        Ok(Pool { idle_tx, idle_rx, len, width, height })
     }
-    let mut interpreter = builder.build(&m).unwrap();
-
-    let (width, height);
-    {
-        let inputs = interpreter.inputs();
-        let input = &inputs[0];
-        let num_dims = input.num_dims();
-        assert_eq!(num_dims, 4);
-        assert_eq!(input.dim(0), 1);
-        height = input.dim(1);
-        width = input.dim(2);
-        assert_eq!(input.dim(3), 3);
+
+    /// Detects objects in `scaled`, appending them to `objs`.
+    fn detect(&self, scaled: &VideoFrame, objs: &mut Vec<Object<'static>>) -> Result<(), Error> {
+        let mut interpreter = self.idle_rx.recv()
+            .map_err(|_| format_err!("interpreter pool closed"))?;
+        nvr_analytics::copy(scaled, &mut interpreter.inputs()[0]);
+        let r = interpreter.invoke();
+
+        // On failure, skip the outputs but still return the interpreter to the pool.
+        if r.is_ok() {
+            let outputs = interpreter.outputs();
+            let boxes = outputs[0].f32s();
+            let classes = outputs[1].f32s();
+            let scores = outputs[2].f32s();
+            for (i, &score) in scores.iter().enumerate() {
+                if score <= 0.5 {
+                    continue;
+                }
+                let class = classes[i];
+                let l = nvr_analytics::label(class);
+                let box_ = &boxes[4*i..4*i+4];
+                if let Some(label) = l {
+                    objs.push(Object {
+                        y: box_[0],
+                        x: box_[1],
+                        h: box_[2] - box_[0],
+                        w: box_[3] - box_[1],
+                        label,
+                        score,
+                        track: None,
+                    });
+                }
+            }
+        }
+        self.idle_tx.send(interpreter).map_err(|_| format_err!("interpreter pool closed"))?;
+        r.map_err(|()| format_err!("interpreter failed"))
     }
+}
 
-    let url = env::args().nth(1).expect("missing url");
-    let _ffmpeg = moonfire_ffmpeg::Ffmpeg::new();
+/// Annotates the video at `url`, writing captions to `out`.
+fn process(opt: &Opt, pool: &Pool, url: &str, out: impl std::io::Write) -> Result<(), Error> {
     let mut open_options = moonfire_ffmpeg::avutil::Dictionary::new();
-    let mut input = moonfire_ffmpeg::avformat::InputFormatContext::open(&CString::new(url).unwrap(),
-                                                              &mut open_options).unwrap();
-    input.find_stream_info().unwrap();
+    let mut input = moonfire_ffmpeg::avformat::InputFormatContext::open(
+        &CString::new(url)?, &mut open_options)
+        .map_err(|e| format_err!("unable to open: {}", e))?;
+    input.find_stream_info().map_err(|e| format_err!("unable to find stream info: {}", e))?;
 
     // In .mp4 files generated by Moonfire NVR, the video is always stream 0.
     // The timestamp subtitles (if any) are stream 1.
     const VIDEO_STREAM: usize = 0;
 
-    let stream = input.streams().get(VIDEO_STREAM);
+    let streams = input.streams();
+    if streams.len() <= VIDEO_STREAM {
+        bail!("no video stream");
+    }
+    let stream = streams.get(VIDEO_STREAM);
     let time_base = stream.time_base();
     let par = stream.codecpar();
     let mut dopt = moonfire_ffmpeg::avutil::Dictionary::new();
-    dopt.set(cstr!("refcounted_frames"), cstr!("0")).unwrap();  // TODO?
-    let d = par.new_decoder(&mut dopt).unwrap();
+    dopt.set(cstr!("refcounted_frames"), cstr!("0"))
+        .map_err(|e| format_err!("unable to set decoder options: {}", e))?;  // TODO?
+    let d = par.new_decoder(&mut dopt).map_err(|e| format_err!("unable to decode: {}", e))?;
 
     let mut scaled = VideoFrame::owned(moonfire_ffmpeg::avutil::ImageDimensions {
-        width: i32::try_from(width).unwrap(),
-        height: i32::try_from(height).unwrap(),
+        width: i32::try_from(pool.width)?,
+        height: i32::try_from(pool.height)?,
         pix_fmt: moonfire_ffmpeg::avutil::PixelFormat::rgb24(),
-    }).unwrap();
-    let mut f = VideoFrame::empty().unwrap();
-    let mut s = moonfire_ffmpeg::swscale::Scaler::new(par.dims(), scaled.dims()).unwrap();
-    let mut prev_pts = 0;
-    let mut prev_objs: Vec<Object> = Vec::new();
-    let stdout = std::io::stdout();
-    let mut stdout = stdout.lock();
-    write!(&mut stdout, "WEBVTT\n\n").unwrap();
+    }).map_err(|e| format_err!("unable to allocate frame: {}", e))?;
+    let mut f = VideoFrame::empty().map_err(|e| format_err!("unable to allocate frame: {}", e))?;
+    let mut s = moonfire_ffmpeg::swscale::Scaler::new(par.dims(), scaled.dims())
+        .map_err(|e| format_err!("unable to scale: {}", e))?;
+    let mut objs: Vec<Object> = Vec::new();
+    let mut gate = nvr_analytics::motion::Gate::new(opt.motion_threshold);
+    let mut out = Writer::new(out, time_base, opt.coalesce_iou)?;
+    let mut tracker = opt.detect_interval.map(|_| Tracker::new(TRACK_MIN_IOU, TRACK_MAX_MISSES));
+    let mut detections = Vec::new();
+
+    // When tracking, the number of frames since the detector last ran, or `None` before it has.
+    let mut since_detect: Option<u32> = None;
     loop {
         let pkt = match input.read_frame() {
             Ok(p) => p,
             Err(e) if e.is_eof() => { break; },
-            Err(e) => panic!("{}", e),
+            Err(e) => bail!("unable to read: {}", e),
         };
         if pkt.stream_index() != VIDEO_STREAM {
             continue;
         }
-        if !d.decode_video(&pkt, &mut f).unwrap() {
+        if !d.decode_video(&pkt, &mut f).map_err(|e| format_err!("unable to decode: {}", e))? {
             continue;
         }
-        write_objs(&mut stdout, Pts(prev_pts, time_base), Pts(f.pts(), time_base),
-                   &prev_objs).unwrap();
-        prev_objs.clear();
-        prev_pts = f.pts();
-        s.scale(&f, &mut scaled);
-        nvr_analytics::copy(&scaled, &mut interpreter.inputs()[0]);
-        interpreter.invoke().unwrap();
-        let outputs = interpreter.outputs();
-        let boxes = outputs[0].f32s();
-        let classes = outputs[1].f32s();
-        let scores = outputs[2].f32s();
-        for (i, &score) in scores.iter().enumerate() {
-            if score <= 0.5 {
-                continue;
+
+        // If nothing's moved, the previous frame's objects carry over. The tracker doesn't
+        // advance either, so its velocities are per analyzed frame.
+        if gate.changed(&f) {
+            objs.clear();
+            match tracker.as_mut() {
+                None => {
+                    s.scale(&f, &mut scaled);
+                    pool.detect(&scaled, &mut objs)?;
+                },
+                Some(t) => {
+                    let interval = opt.detect_interval.unwrap();
+                    let due = match since_detect {
+                        None => true,
+                        Some(n) => {
+                            t.predict();
+                            n + 1 >= interval || t.uncertain()
+                        },
+                    };
+                    if due {
+                        s.scale(&f, &mut scaled);
+                        detections.clear();
+                        pool.detect(&scaled, &mut detections)?;
+                        t.update(&detections);
+                        since_detect = Some(0);
+                    } else {
+                        since_detect = since_detect.map(|n| n + 1);
+                    }
+                    t.objects(&mut objs);
+                },
             }
-            let class = classes[i];
-            let l = nvr_analytics::label(class);
-            let box_ = &boxes[4*i..4*i+4];
-            if let Some(label) = l {
-                prev_objs.push(Object {
-                    y: box_[0],
-                    x: box_[1],
-                    h: box_[2] - box_[0],
-                    w: box_[3] - box_[1],
-                    label,
-                    score,
-                });
+        }
+        out.frame(f.pts(), &objs)?;
+    }
+    out.finish(stream.duration())?;
+    Ok(())
+}
+
+/// Annotates the video at `url`, writing captions to `output`. They're written to a temporary
+/// file which is renamed on success, so a failed input doesn't leave a partial `.vtt` behind.
+fn process_to_file(opt: &Opt, pool: &Pool, url: &str, output: &std::path::Path)
+                   -> Result<(), Error> {
+    let mut tmp_name = std::ffi::OsString::from(".");
+    tmp_name.push(output.file_name().expect("outputs are named after their inputs"));
+    tmp_name.push(".tmp");
+    let tmp = output.with_file_name(tmp_name);
+    let r = std::fs::File::create(&tmp)
+        .map_err(Error::from)
+        .and_then(|f| process(opt, pool, url, f))
+        .and_then(|()| Ok(std::fs::rename(&tmp, output)?));
+    if r.is_err() {
+        let _ = std::fs::remove_file(&tmp);
+    }
+    r
+}
+
+fn main() -> Result<(), Error> {
+    let mut h = nvr_analytics::init_logging();
+    let _a = h.async_scope();
+    let mut opt = Opt::from_args();
+    if opt.detect_interval == Some(0) {
+        bail!("--detect-interval must be positive");
+    }
+    if let Some(l) = opt.input_list.as_ref() {
+        let l = std::fs::read_to_string(l)?;
+        opt.inputs.extend(l.lines().map(str::trim).filter(|l| !l.is_empty()).map(str::to_owned));
+    }
+    let outputs = match opt.out_dir.as_ref() {
+        None if opt.inputs.len() == 1 => None,
+        None => bail!("--out-dir is required unless there's exactly one input"),
+        Some(dir) => {
+            let mut outputs = Vec::with_capacity(opt.inputs.len());
+            let mut seen = std::collections::HashSet::new();
+            for i in &opt.inputs {
+                let stem = std::path::Path::new(i).file_stem()
+                    .ok_or_else(|| format_err!("can't name output for input {:?}", i))?;
+                if !seen.insert(stem) {
+                    bail!("multiple inputs would write {}.vtt", stem.to_string_lossy());
+                }
+                let mut name = stem.to_owned();
+                name.push(".vtt");
+                outputs.push(dir.join(name));
             }
+            Some(outputs)
+        },
+    };
+
+    let m = moonfire_tflite::Model::from_static(nvr_analytics::MODEL)
+        .map_err(|_| format_err!("unable to load model"))?;
+    let delegates = moonfire_tflite::edgetpu::Devices::list()
+        .into_iter()
+        .map(|d| d.create_delegate())
+        .collect::<Result<Vec<_>, ()>>()
+        .map_err(|()| format_err!("unable to create delegate"))?;
+    let mut interpreters = delegates.iter().map(|d| {
+        let mut builder = moonfire_tflite::Interpreter::builder();
+        builder.add_borrowed_delegate(d);
+        builder.build(&m)
+    }).collect::<Result<Vec<_>, ()>>().map_err(|()| format_err!("unable to build interpreter"))?;
+    let cpu_m = match (opt.cpu_interpreters, opt.cpu_model.as_ref()) {
+        (0, _) => None,
+        (_, None) => bail!("--cpu-interpreters requires --cpu-model"),
+        (_, Some(p)) => {
+            let data: &'static [u8] = Box::leak(std::fs::read(p)?.into_boxed_slice());
+            Some(moonfire_tflite::Model::from_static(data)
+                 .map_err(|_| format_err!("unable to load CPU model"))?)
+        },
+    };
+    if let Some(cpu_m) = cpu_m.as_ref() {
+        for _ in 0..opt.cpu_interpreters {
+            interpreters.push(moonfire_tflite::Interpreter::builder().build(cpu_m)
+                              .map_err(|()| format_err!("unable to build interpreter"))?);
         }
     }
-    write_objs(&mut stdout, Pts(prev_pts, time_base), Pts(stream.duration(), time_base),
-               &prev_objs).unwrap();
+    if interpreters.is_empty() {
+        bail!("no edge tpu ready and no --cpu-interpreters");
+    }
+    info!("Running {} Edge TPU and {} CPU interpreters", delegates.len(),
+          interpreters.len() - delegates.len());
+    let pool = Pool::new(interpreters)?;
+
+    let _ffmpeg = moonfire_ffmpeg::Ffmpeg::new();
+    let outputs = match outputs {
+        None => {
+            let stdout = std::io::stdout();
+            return process(&opt, &pool, &opt.inputs[0], stdout.lock());
+        },
+        Some(o) => o,
+    };
+
+    // The global pool has a thread per CPU.
+    let jobs = opt.jobs.unwrap_or_else(|| rayon::current_num_threads() + pool.len);
+    let threads = rayon::ThreadPoolBuilder::new().num_threads(jobs).build()?;
+    let failures = threads.install(|| {
+        opt.inputs.par_iter().zip(outputs.par_iter()).filter(|(input, output)| {
+            match process_to_file(&opt, &pool, input, output) {
+                Ok(()) => {
+                    info!("{} -> {}", input, output.display());
+                    false
+                },
+                Err(e) => {
+                    error!("{}: {}", input, e);
+                    true
+                },
+            }
+        }).count()
+    });
+    if failures > 0 {
+        bail!("{} of {} inputs failed", failures, opt.inputs.len());
+    }
+    Ok(())
 }
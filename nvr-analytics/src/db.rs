@@ -0,0 +1,115 @@
+//! Opens the database, upgrading its schema if it was created by an earlier `schema.sql`.
+//!
+//! `schema.sql` sets `pragma user_version` to `SCHEMA_VERSION`. Databases from before
+//! versioning are version 0: they lack the `zstd_dictionary` table,
+//! `recording_object_detection.frame_data_dictionary_id`, and the `backfill_work` queue.
+
+use failure::{Error, bail};
+use rusqlite::params;
+
+/// The schema version created by `schema.sql`.
+pub const SCHEMA_VERSION: i32 = 1;
+
+/// Opens the database at `path` for writing, upgrading it to `SCHEMA_VERSION` if needed.
+pub fn open(path: &std::path::Path) -> Result<rusqlite::Connection, Error> {
+    let mut conn = rusqlite::Connection::open(path)?;
+    upgrade(&mut conn)?;
+    Ok(conn)
+}
+
+fn has_column(conn: &rusqlite::Connection, table: &str, column: &str) -> Result<bool, Error> {
+    let mut stmt = conn.prepare(&format!("pragma table_info({})", table))?;
+    let mut rows = stmt.query(params![])?;
+    while let Some(row) = rows.next()? {
+        if row.get::<_, String>(1)? == column {
+            return Ok(true);
+        }
+    }
+    Ok(false)
+}
+
+/// Upgrades the schema to `SCHEMA_VERSION` in a single transaction.
+///
+/// Each step tolerates a database which already has some of its changes, as does one created
+/// by a `schema.sql` of the same version from before it set `user_version`.
+pub fn upgrade(conn: &mut rusqlite::Connection) -> Result<(), Error> {
+    let version: i32 = conn.query_row("pragma user_version", params![], |row| row.get(0))?;
+    if version > SCHEMA_VERSION {
+        bail!("database schema version {} is newer than this program's {}; upgrade it",
+              version, SCHEMA_VERSION);
+    }
+    if version == SCHEMA_VERSION {
+        return Ok(());
+    }
+
+    // Take the write lock up front so concurrent upgraders don't both try to alter the tables.
+    let tx = conn.transaction_with_behavior(rusqlite::TransactionBehavior::Immediate)?;
+    let version: i32 = tx.query_row("pragma user_version", params![], |row| row.get(0))?;
+    if version == 0 {
+        tx.execute_batch(r#"
+            create table if not exists zstd_dictionary (
+              id integer primary key,
+              data blob not null
+            );
+
+            create table if not exists backfill_work (
+              camera_uuid not null check (length(camera_uuid) = 16),
+              stream_name not null check (stream_name in ('main', 'sub')),
+              recording_id integer not null,
+              priority integer not null default 0,
+              lease_owner text,
+              lease_expires_sec integer,
+              primary key (camera_uuid, stream_name, recording_id)
+            );
+
+            create index if not exists backfill_work_lease_owner on backfill_work (lease_owner);
+        "#)?;
+        if !has_column(&tx, "recording_object_detection", "frame_data_dictionary_id")? {
+            tx.execute_batch(r#"
+                alter table recording_object_detection
+                    add column frame_data_dictionary_id integer references zstd_dictionary (id);
+            "#)?;
+        }
+    }
+    tx.execute_batch(&format!("pragma user_version = {}", SCHEMA_VERSION))?;
+    tx.commit()?;
+    Ok(())
+}
+
+#[cfg(test)]
+mod test {
+    use rusqlite::params;
+
+    #[test]
+    fn upgrade_from_v0() {
+        let mut conn = rusqlite::Connection::open_in_memory().unwrap();
+        conn.execute_batch(r#"
+            create table recording_object_detection (
+              camera_uuid not null check (length(camera_uuid) = 16),
+              stream_name not null check (stream_name in ('main', 'sub')),
+              recording_id integer not null,
+              frame_data blob not null,
+              durations blob not null,
+              primary key (camera_uuid, stream_name, recording_id)
+            );
+        "#).unwrap();
+        super::upgrade(&mut conn).unwrap();
+        assert!(super::has_column(&conn, "recording_object_detection",
+                                  "frame_data_dictionary_id").unwrap());
+        conn.execute("insert into backfill_work (camera_uuid, stream_name, recording_id) \
+                      values (zeroblob(16), 'sub', 1)", params![]).unwrap();
+        let version: i32 = conn.query_row("pragma user_version", params![], |row| row.get(0))
+            .unwrap();
+        assert_eq!(version, super::SCHEMA_VERSION);
+
+        // Upgrading again is a no-op.
+        super::upgrade(&mut conn).unwrap();
+    }
+
+    #[test]
+    fn current_schema() {
+        let mut conn = rusqlite::Connection::open_in_memory().unwrap();
+        conn.execute_batch(include_str!("schema.sql")).unwrap();
+        super::upgrade(&mut conn).unwrap();
+    }
+}
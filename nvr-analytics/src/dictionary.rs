@@ -0,0 +1,49 @@
+//! zstd dictionaries for `recording_object_detection.frame_data`.
+//!
+//! Each recording's `frame_data` is small and similar to its neighbors', so a dictionary trained
+//! on existing rows (see the `train_dictionary` binary) improves the compression ratio a lot,
+//! even at low (fast) compression levels.
+
+use failure::Error;
+use rusqlite::{OptionalExtension, params};
+use std::io::{Read, Write};
+
+/// Loads the dictionary with the given id.
+pub fn load(conn: &rusqlite::Connection, id: i64) -> Result<Vec<u8>, Error> {
+    Ok(conn.query_row("select data from zstd_dictionary where id = ?", params![id],
+                      |row| row.get(0))?)
+}
+
+/// Loads the most recently trained dictionary, if any.
+pub fn load_newest(conn: &rusqlite::Connection) -> Result<Option<(i64, Vec<u8>)>, Error> {
+    Ok(conn.query_row("select id, data from zstd_dictionary order by id desc limit 1",
+                      params![], |row| Ok((row.get(0)?, row.get(1)?)))
+       .optional()?)
+}
+
+/// Compresses `data`, with a dictionary if supplied.
+pub fn compress(data: &[u8], level: i32, dict: Option<&zstd::dict::EncoderDictionary<'_>>)
+                -> std::io::Result<Vec<u8>> {
+    match dict {
+        None => zstd::stream::encode_all(data, level),
+        Some(d) => {
+            let mut e = zstd::stream::Encoder::with_prepared_dictionary(
+                Vec::with_capacity(data.len()), d)?;
+            e.write_all(data)?;
+            e.finish()
+        },
+    }
+}
+
+/// Decompresses `data`, which must have been compressed with `dict` (or without a dictionary if
+/// `None`).
+pub fn decompress(data: &[u8], dict: Option<&[u8]>) -> std::io::Result<Vec<u8>> {
+    match dict {
+        None => zstd::stream::decode_all(data),
+        Some(d) => {
+            let mut out = Vec::new();
+            zstd::stream::Decoder::with_dictionary(data, d)?.read_to_end(&mut out)?;
+            Ok(out)
+        },
+    }
+}
@@ -0,0 +1,194 @@
+//! Converts H.264 from its ISO-14496 (`.mp4`) form to Annex B byte streams.
+//!
+//! In an `.mp4`, the SPS and PPS are in the sample entry's `avcC` box, and each NAL unit of a
+//! sample is prefixed by its length. ffmpeg's raw `h264` demuxer instead expects parameter sets
+//! inline and NAL units separated by start codes. This lets a stream of `.mp4` packets be piped
+//! through that demuxer, as with `streaming`.
+
+use failure::{Error, bail, format_err};
+use std::convert::TryFrom;
+
+const START_CODE: [u8; 4] = [0, 0, 0, 1];
+
+/// The parts of an `AVCDecoderConfigurationRecord` needed for conversion.
+pub struct AvcConfig {
+    /// The size in bytes of each NAL unit's length prefix: 1, 2, or 4.
+    length_size: usize,
+
+    /// The SPS and PPS NAL units, in Annex B form.
+    parameter_sets: Vec<u8>,
+}
+
+/// Splits the first ISO/IEC 14496-12 box from `data`, returning its type, body, and the rest.
+fn split_box(data: &[u8]) -> Result<([u8; 4], &[u8], &[u8]), Error> {
+    if data.len() < 8 {
+        bail!("truncated box header");
+    }
+    let typ = <[u8; 4]>::try_from(&data[4..8]).unwrap();
+    let (hdr_len, len) = match u32::from_be_bytes(<[u8; 4]>::try_from(&data[0..4]).unwrap()) {
+        0 => (8, data.len()),
+        1 => {
+            if data.len() < 16 {
+                bail!("truncated largesize box header");
+            }
+            let len = u64::from_be_bytes(<[u8; 8]>::try_from(&data[8..16]).unwrap());
+            (16, usize::try_from(len)?)
+        },
+        l => (8, usize::try_from(l)?),
+    };
+    if len < hdr_len || len > data.len() {
+        bail!("{} box has bad length {}", String::from_utf8_lossy(&typ), len);
+    }
+    Ok((typ, &data[hdr_len..len], &data[len..]))
+}
+
+/// Iterates through the boxes in `data`, yielding each one's type and body.
+fn boxes<'a>(mut data: &'a [u8]) -> impl Iterator<Item = Result<([u8; 4], &'a [u8]), Error>> {
+    std::iter::from_fn(move || {
+        if data.is_empty() {
+            return None;
+        }
+        Some(match split_box(data) {
+            Ok((typ, body, rest)) => {
+                data = rest;
+                Ok((typ, body))
+            },
+            Err(e) => {
+                data = &[];
+                Err(e)
+            },
+        })
+    })
+}
+
+/// Returns the body of the first `avcC` box within `data`, descending into the boxes which
+/// can contain it.
+fn find_avcc(data: &[u8]) -> Result<Option<&[u8]>, Error> {
+    for b in boxes(data) {
+        let (typ, body) = b?;
+        let children = match &typ {
+            b"avcC" => return Ok(Some(body)),
+            b"moov" | b"trak" | b"mdia" | b"minf" | b"stbl" => body,
+
+            // A full box header and entry count precede the sample entries.
+            b"stsd" if body.len() >= 8 => &body[8..],
+
+            // A VisualSampleEntry has 78 bytes of fields before its child boxes.
+            b"avc1" | b"avc3" if body.len() >= 78 => &body[78..],
+            _ => continue,
+        };
+        if let Some(avcc) = find_avcc(children)? {
+            return Ok(Some(avcc));
+        }
+    }
+    Ok(None)
+}
+
+/// Extracts the initialization segment (the `ftyp` and `moov` boxes) from a whole `.mp4` file.
+pub fn init_segment(file: &[u8]) -> Result<Vec<u8>, Error> {
+    let mut out = Vec::new();
+    let mut data = file;
+    while !data.is_empty() {
+        let (typ, _, rest) = split_box(data)?;
+        if &typ == b"ftyp" || &typ == b"moov" {
+            out.extend_from_slice(&data[..data.len() - rest.len()]);
+        }
+        data = rest;
+    }
+    Ok(out)
+}
+
+/// Parses the `avcC` box from an initialization segment (`ftyp` and `moov`).
+pub fn parse_init_segment(init: &[u8]) -> Result<AvcConfig, Error> {
+    let avcc = find_avcc(init)?.ok_or_else(|| format_err!("no avcC box in init segment"))?;
+    if avcc.len() < 6 || avcc[0] != 1 {
+        bail!("bad AVCDecoderConfigurationRecord");
+    }
+    let length_size = usize::from(avcc[4] & 0b11) + 1;
+    if length_size == 3 {
+        bail!("bad NAL length size 3");
+    }
+    let mut parameter_sets = Vec::new();
+    let mut pos = 5;
+    for &mask in &[0b1_1111, 0b1111_1111] {  // SPS count, then PPS count.
+        let count = avcc.get(pos).ok_or_else(|| format_err!("truncated avcC"))? & mask;
+        pos += 1;
+        for _ in 0..count {
+            if pos + 2 > avcc.len() {
+                bail!("truncated avcC");
+            }
+            let len = usize::from(u16::from_be_bytes([avcc[pos], avcc[pos + 1]]));
+            pos += 2;
+            let nal = avcc.get(pos..pos + len).ok_or_else(|| format_err!("truncated avcC"))?;
+            parameter_sets.extend_from_slice(&START_CODE[..]);
+            parameter_sets.extend_from_slice(nal);
+            pos += len;
+        }
+    }
+    Ok(AvcConfig {
+        length_size,
+        parameter_sets,
+    })
+}
+
+impl AvcConfig {
+    /// Returns the SPS and PPS in Annex B form, to write at the start of the stream.
+    pub fn parameter_sets(&self) -> &[u8] { &self.parameter_sets[..] }
+
+    /// Appends `packet`'s NAL units to `out` in Annex B form.
+    pub fn append_annex_b(&self, mut packet: &[u8], out: &mut Vec<u8>) -> Result<(), Error> {
+        out.reserve(packet.len());
+        while !packet.is_empty() {
+            if packet.len() < self.length_size {
+                bail!("truncated NAL length");
+            }
+            let len = packet[..self.length_size].iter()
+                .fold(0usize, |len, &b| (len << 8) | usize::from(b));
+            let nal = packet.get(self.length_size..self.length_size + len)
+                .ok_or_else(|| format_err!("NAL length {} exceeds packet", len))?;
+            out.extend_from_slice(&START_CODE[..]);
+            out.extend_from_slice(nal);
+            packet = &packet[self.length_size + len..];
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod test {
+    /// Wraps `body` in a box of type `typ`.
+    fn mp4_box(typ: &[u8; 4], body: &[u8]) -> Vec<u8> {
+        let mut b = Vec::new();
+        b.extend_from_slice(&(8 + body.len() as u32).to_be_bytes());
+        b.extend_from_slice(&typ[..]);
+        b.extend_from_slice(body);
+        b
+    }
+
+    #[test]
+    fn convert() {
+        let avcc = mp4_box(b"avcC", &[
+            1, 0x4d, 0x00, 0x1f, 0xff,  // version, profile, compat, level, length size 4.
+            0xe1, 0, 3, 0x67, 1, 2,     // 1 SPS.
+            1, 0, 2, 0x68, 3,           // 1 PPS.
+        ]);
+        let mut avc1 = vec![0; 78];
+        avc1.extend_from_slice(&avcc);
+        let mut stsd = vec![0, 0, 0, 0, 0, 0, 0, 1];
+        stsd.extend_from_slice(&mp4_box(b"avc1", &avc1));
+        let init = [
+            mp4_box(b"ftyp", b"isom"),
+            mp4_box(b"moov", &mp4_box(b"trak", &mp4_box(b"mdia", &mp4_box(b"minf",
+                &mp4_box(b"stbl", &mp4_box(b"stsd", &stsd)))))),
+        ].concat();
+        let file = [&init[..], &mp4_box(b"mdat", &[1, 2, 3])].concat();
+        assert_eq!(super::init_segment(&file).unwrap(), init);
+        let config = super::parse_init_segment(&init).unwrap();
+        assert_eq!(config.parameter_sets(), &[0, 0, 0, 1, 0x67, 1, 2, 0, 0, 0, 1, 0x68, 3]);
+
+        let mut out = Vec::new();
+        config.append_annex_b(&[0, 0, 0, 2, 0x65, 4, 0, 0, 0, 1, 0x06], &mut out).unwrap();
+        assert_eq!(&out[..], &[0, 0, 0, 1, 0x65, 4, 0, 0, 0, 1, 0x06]);
+        config.append_annex_b(&[0, 0, 0, 9, 0x65], &mut out).unwrap_err();
+    }
+}
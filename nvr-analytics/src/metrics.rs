@@ -0,0 +1,277 @@
+//! Lightweight per-stage timing and queue-depth instrumentation.
+//!
+//! `Metrics` keeps a log2-bucketed histogram per named stage and a sampled gauge per named
+//! queue. Recording is lock-free (a few relaxed atomic adds), so it's cheap enough to leave on
+//! in the hot path. Optionally, it also keeps every span and sample for export as a Chrome trace
+//! (`chrome://tracing` or <https://ui.perfetto.dev/>); that's not free, so it's off by default.
+
+use serde::Serialize;
+use std::convert::TryFrom;
+use std::fmt::Write as _;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::time::{Duration, Instant};
+
+/// One bucket per power of two microseconds: bucket `i` holds durations in `[2^(i-1), 2^i)` µs,
+/// with bucket 0 holding durations under 1 µs. 40 buckets go past 6 days.
+const NUM_BUCKETS: usize = 40;
+
+pub struct Histogram {
+    buckets: Vec<AtomicU64>,
+    count: AtomicU64,
+    sum_us: AtomicU64,
+    max_us: AtomicU64,
+}
+
+impl Histogram {
+    pub fn new() -> Self {
+        Histogram {
+            buckets: (0..NUM_BUCKETS).map(|_| AtomicU64::new(0)).collect(),
+            count: AtomicU64::new(0),
+            sum_us: AtomicU64::new(0),
+            max_us: AtomicU64::new(0),
+        }
+    }
+
+    pub fn record(&self, d: Duration) {
+        let us = u64::try_from(d.as_micros()).unwrap_or(u64::max_value());
+        let bucket = std::cmp::min(64 - us.leading_zeros() as usize, NUM_BUCKETS - 1);
+        self.buckets[bucket].fetch_add(1, Ordering::Relaxed);
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.sum_us.fetch_add(us, Ordering::Relaxed);
+        self.max_us.fetch_max(us, Ordering::Relaxed);
+    }
+
+    pub fn count(&self) -> u64 { self.count.load(Ordering::Relaxed) }
+    pub fn sum(&self) -> Duration { Duration::from_micros(self.sum_us.load(Ordering::Relaxed)) }
+    pub fn max(&self) -> Duration { Duration::from_micros(self.max_us.load(Ordering::Relaxed)) }
+
+    pub fn mean(&self) -> Duration {
+        match self.count() {
+            0 => Duration::from_micros(0),
+            c => Duration::from_micros(self.sum_us.load(Ordering::Relaxed) / c),
+        }
+    }
+
+    /// Returns an upper bound on the `p`th quantile (`0.0..=1.0`), accurate to a factor of two.
+    pub fn quantile(&self, p: f64) -> Duration {
+        let count = self.count();
+        if count == 0 {
+            return Duration::from_micros(0);
+        }
+        let target = std::cmp::max(1, (p * count as f64).ceil() as u64);
+        let mut seen = 0;
+        for (i, b) in self.buckets.iter().enumerate() {
+            seen += b.load(Ordering::Relaxed);
+            if seen >= target {
+                let upper_us = if i == 0 { 1 } else { 1u64 << i };
+                return std::cmp::min(Duration::from_micros(upper_us), self.max());
+            }
+        }
+        self.max()
+    }
+}
+
+/// A periodically sampled value, such as a queue depth.
+pub struct Gauge {
+    samples: AtomicU64,
+    sum: AtomicU64,
+    max: AtomicU64,
+}
+
+impl Gauge {
+    pub fn new() -> Self {
+        Gauge {
+            samples: AtomicU64::new(0),
+            sum: AtomicU64::new(0),
+            max: AtomicU64::new(0),
+        }
+    }
+
+    pub fn sample(&self, value: u64) {
+        self.samples.fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(value, Ordering::Relaxed);
+        self.max.fetch_max(value, Ordering::Relaxed);
+    }
+
+    pub fn mean(&self) -> f64 {
+        match self.samples.load(Ordering::Relaxed) {
+            0 => 0.,
+            s => self.sum.load(Ordering::Relaxed) as f64 / s as f64,
+        }
+    }
+
+    pub fn max(&self) -> u64 { self.max.load(Ordering::Relaxed) }
+}
+
+/// An event in the [Chrome trace event
+/// format](https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU).
+#[derive(Serialize)]
+struct TraceEvent {
+    name: &'static str,
+    ph: &'static str,
+    pid: u32,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    tid: Option<u64>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    ts: Option<u64>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    dur: Option<u64>,
+    #[serde(skip_serializing_if = "Option::is_none")]
+    args: Option<serde_json::Value>,
+}
+
+#[derive(Serialize)]
+struct TraceFile<'a> {
+    #[serde(rename = "traceEvents")]
+    trace_events: &'a [TraceEvent],
+}
+
+fn thread_id() -> u64 {
+    static NEXT_ID: AtomicU64 = AtomicU64::new(1);
+    thread_local! {
+        static ID: u64 = NEXT_ID.fetch_add(1, Ordering::Relaxed);
+    }
+    ID.with(|id| *id)
+}
+
+struct Trace {
+    start: Instant,
+    events: parking_lot::Mutex<Vec<TraceEvent>>,
+    thread_names: parking_lot::Mutex<std::collections::BTreeMap<u64, String>>,
+}
+
+pub struct Metrics {
+    stage_names: &'static [&'static str],
+    stages: Vec<Histogram>,
+    gauge_names: &'static [&'static str],
+    gauges: Vec<Gauge>,
+    trace: Option<Trace>,
+}
+
+impl Metrics {
+    /// Creates metrics with the given stage and gauge names, which are referred to by index.
+    pub fn new(stage_names: &'static [&'static str], gauge_names: &'static [&'static str],
+               trace: bool) -> Self {
+        Metrics {
+            stage_names,
+            stages: stage_names.iter().map(|_| Histogram::new()).collect(),
+            gauge_names,
+            gauges: gauge_names.iter().map(|_| Gauge::new()).collect(),
+            trace: if trace {
+                Some(Trace {
+                    start: Instant::now(),
+                    events: parking_lot::Mutex::new(Vec::new()),
+                    thread_names: parking_lot::Mutex::new(std::collections::BTreeMap::new()),
+                })
+            } else {
+                None
+            },
+        }
+    }
+
+    /// Records that `stage` ran on this thread from `start` until now.
+    pub fn record(&self, stage: usize, start: Instant) {
+        let now = Instant::now();
+        let d = now.saturating_duration_since(start);
+        self.stages[stage].record(d);
+        if let Some(t) = self.trace.as_ref() {
+            let tid = thread_id();
+            t.thread_names.lock().entry(tid).or_insert_with(|| {
+                std::thread::current().name().unwrap_or("unnamed").to_owned()
+            });
+            let ts = start.saturating_duration_since(t.start);
+            t.events.lock().push(TraceEvent {
+                name: self.stage_names[stage],
+                ph: "X",
+                pid: 1,
+                tid: Some(tid),
+                ts: Some(u64::try_from(ts.as_micros()).unwrap()),
+                dur: Some(u64::try_from(d.as_micros()).unwrap()),
+                args: None,
+            });
+        }
+    }
+
+    /// Records a duration for `stage` which wasn't spent on this thread, such as a latency
+    /// spanning processes. It's included in the summary but not the trace.
+    pub fn record_duration(&self, stage: usize, d: Duration) { self.stages[stage].record(d); }
+
+    /// Records a sample of `gauge`.
+    pub fn sample(&self, gauge: usize, value: usize) {
+        let value = u64::try_from(value).unwrap();
+        self.gauges[gauge].sample(value);
+        if let Some(t) = self.trace.as_ref() {
+            let ts = t.start.elapsed();
+            t.events.lock().push(TraceEvent {
+                name: self.gauge_names[gauge],
+                ph: "C",
+                pid: 1,
+                tid: None,
+                ts: Some(u64::try_from(ts.as_micros()).unwrap()),
+                dur: None,
+                args: Some(serde_json::json!({ "value": value })),
+            });
+        }
+    }
+
+    pub fn stage(&self, stage: usize) -> &Histogram { &self.stages[stage] }
+
+    /// Returns a human-readable table of all stages and gauges.
+    pub fn summary(&self) -> String {
+        let mut out = String::new();
+        writeln!(&mut out, "{:<14} {:>10} {:>12} {:>10} {:>10} {:>10} {:>10} {:>10}",
+                 "stage", "count", "total", "mean", "p50", "p90", "p99", "max").unwrap();
+        for (name, h) in self.stage_names.iter().zip(self.stages.iter()) {
+            writeln!(&mut out,
+                     "{:<14} {:>10} {:>12.3?} {:>10.3?} {:>10.3?} {:>10.3?} {:>10.3?} {:>10.3?}",
+                     name, h.count(), h.sum(), h.mean(), h.quantile(0.5), h.quantile(0.9),
+                     h.quantile(0.99), h.max()).unwrap();
+        }
+        writeln!(&mut out, "{:<14} {:>10} {:>10}", "gauge", "mean", "max").unwrap();
+        for (name, g) in self.gauge_names.iter().zip(self.gauges.iter()) {
+            writeln!(&mut out, "{:<14} {:>10.1} {:>10}", name, g.mean(), g.max()).unwrap();
+        }
+        out
+    }
+
+    /// Writes the Chrome trace, if enabled.
+    pub fn write_trace(&self, w: impl std::io::Write) -> Result<(), serde_json::Error> {
+        let t = match self.trace.as_ref() {
+            None => return Ok(()),
+            Some(t) => t,
+        };
+        let mut events = t.thread_names.lock().iter().map(|(&tid, name)| TraceEvent {
+            name: "thread_name",
+            ph: "M",
+            pid: 1,
+            tid: Some(tid),
+            ts: None,
+            dur: None,
+            args: Some(serde_json::json!({ "name": name })),
+        }).collect::<Vec<_>>();
+        events.append(&mut t.events.lock());
+        serde_json::to_writer(std::io::BufWriter::new(w), &TraceFile {
+            trace_events: &events[..],
+        })
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::time::Duration;
+
+    #[test]
+    fn quantiles() {
+        let h = super::Histogram::new();
+        for us in 1..=100 {
+            h.record(Duration::from_micros(us));
+        }
+        assert_eq!(h.count(), 100);
+        assert_eq!(h.max(), Duration::from_micros(100));
+        assert_eq!(h.mean(), Duration::from_micros(50));  // 5050 / 100, truncated.
+
+        // Quantiles are upper bounds, accurate to a factor of two.
+        assert_eq!(h.quantile(0.5), Duration::from_micros(64));
+        assert_eq!(h.quantile(0.99), Duration::from_micros(100));
+    }
+}
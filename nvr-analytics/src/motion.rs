@@ -0,0 +1,145 @@
+//! A cheap gate for skipping object detection on frames where nothing has moved.
+//!
+//! Most footage is static for long stretches. `Gate` compares each decoded frame's luma plane
+//! to that of the last frame it let through, by the sum of absolute differences (SAD) within
+//! each 16x16 block. If no block has changed by more than the threshold, the caller can reuse
+//! the last frame's detections rather than scaling and invoking the model again. Comparing to
+//! the last analyzed frame rather than the previous one means slow changes (a shadow moving, a
+//! car creeping into view) still add up to a pass eventually.
+
+const BLOCK: usize = 16;
+
+pub struct Gate {
+    /// The largest mean absolute difference per pixel which a block may have and still count
+    /// as unchanged. 0 lets every frame through.
+    threshold: u32,
+
+    /// The luma plane of the last frame let through, packed, or empty if there's none yet.
+    reference: Vec<u8>,
+    width: usize,
+    height: usize,
+
+    /// Per-block-column SAD accumulators for the current row of blocks.
+    sums: Vec<u32>,
+}
+
+impl Gate {
+    pub fn new(threshold: u8) -> Self {
+        Gate {
+            threshold: u32::from(threshold),
+            reference: Vec::new(),
+            width: 0,
+            height: 0,
+            sums: Vec::new(),
+        }
+    }
+
+    /// Returns true if `frame` should be analyzed, in which case it becomes the new reference.
+    /// `frame` must be in a planar format whose first plane is 8-bit luma, as H.264 decoders
+    /// produce.
+    pub fn changed(&mut self, frame: &moonfire_ffmpeg::avutil::VideoFrame) -> bool {
+        let p = frame.plane(0);
+        self.changed_plane(p.data, p.linesize, p.width, p.height)
+    }
+
+    /// As `changed`, for a plane of `height` rows of `width` bytes each, `linesize` apart.
+    pub fn changed_plane(&mut self, data: &[u8], linesize: usize, width: usize, height: usize)
+                         -> bool {
+        if self.threshold == 0 {
+            return true;  // Disabled; no need to keep a reference.
+        }
+        if width != self.width || height != self.height || self.reference.is_empty()
+           || self.any_block_changed(data, linesize) {
+            self.width = width;
+            self.height = height;
+            self.reference.clear();
+            self.reference.reserve(width * height);
+            for y in 0..height {
+                self.reference.extend_from_slice(&data[y * linesize .. y * linesize + width]);
+            }
+            return true;
+        }
+        false
+    }
+
+    fn any_block_changed(&mut self, data: &[u8], linesize: usize) -> bool {
+        let (w, h) = (self.width, self.height);
+        let cols = (w + BLOCK - 1) / BLOCK;
+        self.sums.clear();
+        self.sums.resize(cols, 0);
+        for y in 0..h {
+            let cur = &data[y * linesize .. y * linesize + w];
+            let prev = &self.reference[y * w .. (y + 1) * w];
+            for ((sum, cur), prev) in self.sums.iter_mut()
+                                               .zip(cur.chunks(BLOCK))
+                                               .zip(prev.chunks(BLOCK)) {
+                *sum += sad(cur, prev);
+            }
+
+            // At the end of each row of blocks, check and reset them. Blocks on the right and
+            // bottom edges may be smaller; compare their mean, not their sum.
+            let last_row = y + 1 == h;
+            if (y + 1) % BLOCK == 0 || last_row {
+                let block_h = y % BLOCK + 1;
+                for (col, sum) in self.sums.iter_mut().enumerate() {
+                    let block_w = std::cmp::min(BLOCK, w - col * BLOCK);
+                    if *sum > self.threshold * (block_w * block_h) as u32 {
+                        return true;
+                    }
+                    *sum = 0;
+                }
+            }
+        }
+        false
+    }
+}
+
+/// Returns the sum of absolute differences of two equal-length slices.
+///
+/// This is written so LLVM vectorizes it (to `psadbw` on x86-64 and `uabd`/`uadalp` on
+/// aarch64) without target-specific code.
+#[inline]
+fn sad(a: &[u8], b: &[u8]) -> u32 {
+    a.iter().zip(b).map(|(&a, &b)| u32::from(if a > b { a - b } else { b - a })).sum()
+}
+
+#[cfg(test)]
+mod test {
+    #[test]
+    fn gate() {
+        const W: usize = 40;
+        const H: usize = 20;
+        const LINESIZE: usize = 48;
+        let mut g = super::Gate::new(4);
+        let mut frame = vec![100u8; LINESIZE * H];
+        assert!(g.changed_plane(&frame, LINESIZE, W, H));  // first frame.
+        assert!(!g.changed_plane(&frame, LINESIZE, W, H));
+
+        // Noise spread across the frame stays under the threshold, as do changes in the padding.
+        for (i, p) in frame.iter_mut().enumerate() {
+            *p = if i % 2 == 0 { 103 } else { 97 };
+        }
+        for y in 0..H {
+            frame[y * LINESIZE + W] = 0;
+        }
+        assert!(!g.changed_plane(&frame, LINESIZE, W, H));
+
+        // A small bright object in the partial block at the bottom-right corner gets through,
+        // and becomes the reference.
+        for y in 16..20 {
+            for x in 36..40 {
+                frame[y * LINESIZE + x] = 255;
+            }
+        }
+        assert!(g.changed_plane(&frame, LINESIZE, W, H));
+        assert!(!g.changed_plane(&frame, LINESIZE, W, H));
+
+        // So does a change in dimensions.
+        assert!(g.changed_plane(&frame, LINESIZE, W - 1, H));
+
+        // A threshold of 0 disables the gate.
+        let mut g = super::Gate::new(0);
+        assert!(g.changed_plane(&frame, LINESIZE, W, H));
+        assert!(g.changed_plane(&frame, LINESIZE, W, H));
+    }
+}
@@ -1,12 +1,15 @@
+-- The schema version; see db.rs, which upgrades databases from earlier
+-- versions when they're opened.
+pragma user_version = 1;
+
 create table object_detection_model (
   id integer primary key,
   uuid blob unique not null check (length(uuid) = 16),
   name text not null,
 
-  -- The actual model and label mappings, in a tbd protocol buffer message
-  -- format. Currently one model is hardcoded so this column is left null.
-  -- The format should include both the actual model and a mapping
-  -- from the model's label ids to object_detection_label.uuid.
+  -- The actual model and label mappings, as a serialized ModelData message
+  -- (see inferencer.proto), written by the add_model binary. Models with a
+  -- null data are not served by inferencer_server --db.
   data blob
 );
 
@@ -102,6 +105,13 @@ insert into object_detection_label (id, uuid, name, color)
            (88, X'20067AB3686748B297FF46836CD4AA61', 'hair drier', 'black'),
            (89, X'FD13D02E02DE484DB813BA26EC19BF71', 'toothbrush', 'black');
 
+-- zstd dictionaries for recording_object_detection.frame_data, trained on
+-- samples of existing rows by the train_dictionary binary.
+create table zstd_dictionary (
+  id integer primary key,
+  data blob not null
+);
+
 create table recording_object_detection (
   camera_uuid not null check (length(camera_uuid) = 16),
   stream_name not null check (stream_name in ('main', 'sub')),
@@ -141,6 +151,9 @@ create table recording_object_detection (
   --     * score as fixed 8-bit number
   frame_data blob not null,
 
+  -- The dictionary frame_data was compressed with, or null for none.
+  frame_data_dictionary_id integer references zstd_dictionary (id),
+
   -- repeated delta of duration 90k, one per frame.
   durations blob not null,
 
@@ -149,3 +162,32 @@ create table recording_object_detection (
   -- key to make these efficient.
   primary key (camera_uuid, stream_name, recording_id)
 );
+
+-- Recordings waiting for backfill, shared by all backfill processes using
+-- this database. SQLite's locking (and WAL mode in particular) doesn't work
+-- over network filesystems, so processes on other machines reach it through
+-- one on the database's host (backfill --listen; see work_queue.rs). Each
+-- process adds the recordings it finds to be missing from
+-- recording_object_detection, then claims batches by setting lease_owner and
+-- lease_expires_sec. It renews its leases while working and deletes each row
+-- in the same transaction as inserting into recording_object_detection. If a
+-- process dies, its leases expire and the rows are claimed by another.
+create table backfill_work (
+  camera_uuid not null check (length(camera_uuid) = 16),
+  stream_name not null check (stream_name in ('main', 'sub')),
+  recording_id integer not null,
+
+  -- Rows with higher priority are claimed first. Recordings found while
+  -- following new video (backfill --follow) have priority 1; others 0.
+  priority integer not null default 0,
+
+  -- An arbitrary name for the claiming process, or null if unclaimed.
+  lease_owner text,
+
+  -- When the claim expires, in seconds since the Unix epoch.
+  lease_expires_sec integer,
+
+  primary key (camera_uuid, stream_name, recording_id)
+);
+
+create index backfill_work_lease_owner on backfill_work (lease_owner);
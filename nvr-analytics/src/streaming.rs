@@ -0,0 +1,76 @@
+//! Streams HTTP response bodies into ffmpeg as they download.
+//!
+//! ffmpeg reads the body through its `pipe:` protocol from one end of a Unix socket pair; a
+//! tokio task copies the body into the other end. Read-ahead is bounded by the socket buffers,
+//! so memory use per recording is small and constant, and decoding overlaps the download.
+//!
+//! This requires the container to be readable without seeking backward. Moonfire NVR's `.mp4`
+//! files put the `moov` box before the `mdat`, so they are.
+//!
+//! The same mechanism also feeds in-memory files, such as images, to ffmpeg.
+
+use failure::{Error, format_err};
+use std::ffi::CString;
+use std::os::unix::io::AsRawFd;
+use std::future::Future;
+use std::os::unix::net::UnixStream;
+use tokio::io::AsyncWriteExt;
+
+pub struct StreamingBody {
+    reader: UnixStream,
+    done_rx: crossbeam::channel::Receiver<Result<(), Error>>,
+}
+
+impl StreamingBody {
+    /// Starts copying `resp`'s body in a task. Must be called from within a tokio runtime.
+    pub fn spawn(mut resp: reqwest::Response) -> Result<Self, Error> {
+        Self::start(|mut writer| async move {
+            while let Some(chunk) = resp.chunk().await? {
+                writer.write_all(&chunk[..]).await?;
+            }
+            Ok::<_, Error>(())
+        })
+    }
+
+    /// Starts writing `data` in a task. Must be called from within a tokio runtime.
+    pub fn from_bytes(data: Vec<u8>) -> Result<Self, Error> {
+        Self::start(|mut writer| async move {
+            writer.write_all(&data[..]).await?;
+            Ok::<_, Error>(())
+        })
+    }
+
+    /// Spawns a task which runs `copy` on the writing end.
+    fn start<F, Fut>(copy: F) -> Result<Self, Error>
+    where F: FnOnce(tokio::net::UnixStream) -> Fut,
+          Fut: Future<Output = Result<(), Error>> + Send + 'static {
+        let (reader, writer) = UnixStream::pair()?;
+        writer.set_nonblocking(true)?;
+        let writer = tokio::net::UnixStream::from_std(writer)?;
+        let (done_tx, done_rx) = crossbeam::channel::bounded(1);
+        let copy = copy(writer);
+        tokio::spawn(async move {
+            // `copy` owns the writer and drops it on completion, so the reader sees EOF, even
+            // on error.
+            let _ = done_tx.send(copy.await);
+        });
+        Ok(StreamingBody {
+            reader,
+            done_rx,
+        })
+    }
+
+    /// Returns a URL for `InputFormatContext::open` which reads the body.
+    /// It's valid until `self` is dropped.
+    ///
+    /// ffmpeg's `pipe:` protocol doesn't close the descriptor it's given; `self` owns it.
+    pub fn url(&self) -> CString {
+        CString::new(format!("pipe:{}", self.reader.as_raw_fd())).unwrap()
+    }
+
+    /// Waits for the download to finish, returning an error if the body was truncated.
+    /// Call after reading to EOF.
+    pub fn finish(self) -> Result<(), Error> {
+        self.done_rx.recv().map_err(|_| format_err!("body copy task was dropped"))?
+    }
+}
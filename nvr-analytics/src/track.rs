@@ -0,0 +1,286 @@
+//! A lightweight multi-object tracker, for running the detector on only some frames.
+//!
+//! Each track follows one object with a Kalman filter: constant velocity for its box's center
+//! and a random walk for its size, in the same normalized coordinates as detections. Between
+//! detections, `predict` carries every box forward a frame. When the detector runs, `update`
+//! associates its objects with tracks by intersection over union (greedily, best pair first,
+//! within a label), corrects the matched tracks, starts new tracks for the rest, and drops
+//! tracks which have gone unmatched too long. `uncertain` says when the predictions have drifted
+//! enough that the detector should run again early.
+
+use crate::webvtt::Object;
+
+/// Measurement noise: the standard deviation of a detected box's edges, as a fraction of the
+/// frame.
+const MEASUREMENT_SD: f32 = 0.005;
+
+/// Per-frame process noise for a track's position and velocity and for its size.
+const POSITION_SD: f32 = 0.001;
+const VELOCITY_SD: f32 = 0.0005;
+const SIZE_SD: f32 = 0.002;
+
+/// A new track's velocity is unknown; assume up to about this much per frame.
+const INITIAL_VELOCITY_SD: f32 = 0.005;
+
+/// A track is uncertain once its position's standard deviation exceeds this fraction of its
+/// box's size.
+const UNCERTAIN_FRACTION: f32 = 0.25;
+
+/// A one-dimensional constant-velocity Kalman filter.
+#[derive(Clone, Debug)]
+struct Motion {
+    pos: f32,
+    vel: f32,
+
+    /// The covariance matrix `[[pp, pv], [pv, vv]]`.
+    pp: f32,
+    pv: f32,
+    vv: f32,
+}
+
+impl Motion {
+    fn new(pos: f32) -> Self {
+        Motion {
+            pos,
+            vel: 0.,
+            pp: MEASUREMENT_SD * MEASUREMENT_SD,
+            pv: 0.,
+            vv: INITIAL_VELOCITY_SD * INITIAL_VELOCITY_SD,
+        }
+    }
+
+    fn predict(&mut self) {
+        self.pos += self.vel;
+        self.pp += 2. * self.pv + self.vv + POSITION_SD * POSITION_SD;
+        self.pv += self.vv;
+        self.vv += VELOCITY_SD * VELOCITY_SD;
+    }
+
+    fn update(&mut self, measured: f32) {
+        let s = self.pp + MEASUREMENT_SD * MEASUREMENT_SD;
+        let (kp, kv) = (self.pp / s, self.pv / s);
+        let residual = measured - self.pos;
+        self.pos += kp * residual;
+        self.vel += kv * residual;
+        self.vv -= kv * self.pv;
+        self.pv *= 1. - kp;
+        self.pp *= 1. - kp;
+    }
+}
+
+/// A one-dimensional random-walk Kalman filter.
+#[derive(Clone, Debug)]
+struct Level {
+    value: f32,
+    var: f32,
+}
+
+impl Level {
+    fn new(value: f32) -> Self {
+        Level { value, var: MEASUREMENT_SD * MEASUREMENT_SD }
+    }
+
+    fn predict(&mut self) { self.var += SIZE_SD * SIZE_SD; }
+
+    fn update(&mut self, measured: f32) {
+        let k = self.var / (self.var + MEASUREMENT_SD * MEASUREMENT_SD);
+        self.value += k * (measured - self.value);
+        self.var *= 1. - k;
+    }
+}
+
+#[derive(Clone, Debug)]
+struct Track<'a> {
+    id: u64,
+    label: &'a str,
+
+    /// The score of the most recent matching detection.
+    score: f32,
+    cx: Motion,
+    cy: Motion,
+    w: Level,
+    h: Level,
+
+    /// The number of consecutive `update`s which didn't match this track.
+    misses: u32,
+}
+
+impl<'a> Track<'a> {
+    fn new(id: u64, o: &Object<'a>) -> Self {
+        Track {
+            id,
+            label: o.label,
+            score: o.score,
+            cx: Motion::new(o.x + o.w / 2.),
+            cy: Motion::new(o.y + o.h / 2.),
+            w: Level::new(o.w),
+            h: Level::new(o.h),
+            misses: 0,
+        }
+    }
+
+    fn object(&self) -> Object<'a> {
+        let (w, h) = (self.w.value.max(0.), self.h.value.max(0.));
+        Object {
+            label: self.label,
+            score: self.score,
+            x: self.cx.pos - w / 2.,
+            y: self.cy.pos - h / 2.,
+            w,
+            h,
+            track: Some(self.id),
+        }
+    }
+
+    fn uncertain(&self) -> bool {
+        self.cx.pp.sqrt() > UNCERTAIN_FRACTION * self.w.value
+            || self.cy.pp.sqrt() > UNCERTAIN_FRACTION * self.h.value
+    }
+}
+
+pub struct Tracker<'a> {
+    min_iou: f32,
+    max_misses: u32,
+    next_id: u64,
+    tracks: Vec<Track<'a>>,
+}
+
+impl<'a> Tracker<'a> {
+    /// Creates a tracker which matches detections to tracks with at least `min_iou`, and drops
+    /// tracks after `max_misses` consecutive detection runs without a match.
+    pub fn new(min_iou: f32, max_misses: u32) -> Self {
+        Tracker {
+            min_iou,
+            max_misses,
+            next_id: 0,
+            tracks: Vec::new(),
+        }
+    }
+
+    /// Carries every track forward one frame.
+    pub fn predict(&mut self) {
+        for t in &mut self.tracks {
+            t.cx.predict();
+            t.cy.predict();
+            t.w.predict();
+            t.h.predict();
+        }
+    }
+
+    /// Returns true if any current track's position has become too uncertain to trust.
+    pub fn uncertain(&self) -> bool {
+        self.tracks.iter().any(|t| t.misses == 0 && t.uncertain())
+    }
+
+    /// Incorporates the detector's objects for the current frame.
+    pub fn update(&mut self, detections: &[Object<'a>]) {
+        let mut pairs = Vec::new();
+        for (ti, t) in self.tracks.iter().enumerate() {
+            let predicted = t.object();
+            for (di, d) in detections.iter().enumerate() {
+                if d.label != t.label {
+                    continue;
+                }
+                let iou = predicted.iou(d);
+                if iou >= self.min_iou {
+                    pairs.push((iou, ti, di));
+                }
+            }
+        }
+        pairs.sort_by(|a, b| b.0.partial_cmp(&a.0).unwrap());
+        let mut track_matched = vec![false; self.tracks.len()];
+        let mut detection_matched = vec![false; detections.len()];
+        for (_, ti, di) in pairs {
+            if track_matched[ti] || detection_matched[di] {
+                continue;
+            }
+            track_matched[ti] = true;
+            detection_matched[di] = true;
+            let (t, d) = (&mut self.tracks[ti], &detections[di]);
+            t.cx.update(d.x + d.w / 2.);
+            t.cy.update(d.y + d.h / 2.);
+            t.w.update(d.w);
+            t.h.update(d.h);
+            t.score = d.score;
+            t.misses = 0;
+        }
+        for (t, &matched) in self.tracks.iter_mut().zip(&track_matched) {
+            if !matched {
+                t.misses += 1;
+            }
+        }
+        let max_misses = self.max_misses;
+        self.tracks.retain(|t| t.misses <= max_misses);
+        for (d, &matched) in detections.iter().zip(&detection_matched) {
+            if !matched {
+                self.tracks.push(Track::new(self.next_id, d));
+                self.next_id += 1;
+            }
+        }
+    }
+
+    /// Appends the current objects to `objs`: every track matched by the last `update`, at its
+    /// predicted position. Tracks which missed are kept for a while in case the object
+    /// reappears, but not shown.
+    pub fn objects(&self, objs: &mut Vec<Object<'a>>) {
+        objs.extend(self.tracks.iter().filter(|t| t.misses == 0).map(Track::object));
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use crate::webvtt::Object;
+
+    fn obj(label: &str, x: f32) -> Object {
+        Object { label, score: 0.75, x, y: 0.4, w: 0.2, h: 0.2, track: None }
+    }
+
+    #[test]
+    fn track() {
+        let mut t = super::Tracker::new(0.3, 1);
+        let mut objs = Vec::new();
+
+        // A car moving right 0.01 per frame, detected on each of the first 10 frames.
+        for i in 0..10 {
+            if i > 0 {
+                t.predict();
+            }
+            t.update(&[obj("car", 0.1 + 0.01 * i as f32)]);
+        }
+
+        // Its box is carried forward between detections, following the motion.
+        t.predict();
+        t.predict();
+        assert!(!t.uncertain());
+        objs.clear();
+        t.objects(&mut objs);
+        assert_eq!(objs.len(), 1);
+        assert_eq!(objs[0].track, Some(0));
+        assert!((objs[0].x - 0.21).abs() < 0.01, "x={}", objs[0].x);
+
+        // Without detections, it eventually becomes uncertain.
+        for _ in 0..100 {
+            t.predict();
+        }
+        assert!(t.uncertain());
+
+        // The car is found again, keeping its id; a dog is new.
+        t.update(&[obj("dog", 0.6), obj("car", 1.2)]);
+        objs.clear();
+        t.objects(&mut objs);
+        let mut ids: Vec<_> = objs.iter().map(|o| (o.label, o.track.unwrap())).collect();
+        ids.sort();
+        assert_eq!(ids, [("car", 0), ("dog", 1)]);
+
+        // Each is dropped after missing more than once.
+        t.update(&[]);
+        t.update(&[]);
+        objs.clear();
+        t.objects(&mut objs);
+        assert!(objs.is_empty());
+        t.update(&[obj("car", 1.2)]);
+        objs.clear();
+        t.objects(&mut objs);
+        assert_eq!(objs[0].track, Some(2));
+    }
+}
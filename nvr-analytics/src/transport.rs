@@ -0,0 +1,263 @@
+//! A faster transport to an inferencer server on the same host.
+//!
+//! Over TCP, each image is serialized into a protobuf and copied through loopback and HTTP/2.
+//! A co-located client can instead connect through the server's Unix domain socket (a
+//! `unix:<path>` server address) and attach a shared-memory `Ring` of image slots. It then
+//! writes pixels straight into a slot and sends only the slot index; the server copies them
+//! straight from its `Mapping` of the ring into the interpreter's input.
+//!
+//! The ring is a sealed memfd rather than a named file. The client sends its descriptor
+//! number, and the server opens it through `/proc` using the pid from the socket's peer
+//! credentials, so a client can only share memory it holds itself.
+
+use std::fs::File;
+use std::io;
+use std::os::unix::fs::MetadataExt;
+use std::os::unix::io::{AsRawFd, FromRawFd, RawFd};
+use std::path::PathBuf;
+use std::sync::Arc;
+
+/// Connects to an inferencer server at `server`, either a URL or `unix:<path>`.
+pub async fn connect(server: &str)
+                     -> Result<tonic::transport::Channel, tonic::transport::Error> {
+    let path = match server.strip_prefix("unix:") {
+        None => {
+            return tonic::transport::Endpoint::from_shared(server.to_owned())?.connect().await;
+        },
+        Some(p) => PathBuf::from(p),
+    };
+
+    // The URI is required but unused.
+    tonic::transport::Endpoint::from_static("http://[::]:0")
+        .connect_with_connector(tower::service_fn(move |_: tonic::transport::Uri| {
+            tokio::net::UnixStream::connect(path.clone())
+        }))
+        .await
+}
+
+/// The credentials of a Unix domain socket's peer, as of when it connected.
+#[derive(Copy, Clone, Debug)]
+pub struct Peer {
+    pub pid: u32,
+    pub uid: u32,
+}
+
+impl Peer {
+    pub fn of(s: &impl AsRawFd) -> io::Result<Self> {
+        let mut cred = libc::ucred { pid: 0, uid: 0, gid: 0 };
+        let mut len = std::mem::size_of::<libc::ucred>() as libc::socklen_t;
+        let ret = unsafe {
+            libc::getsockopt(s.as_raw_fd(), libc::SOL_SOCKET, libc::SO_PEERCRED,
+                             &mut cred as *mut libc::ucred as *mut libc::c_void, &mut len)
+        };
+        if ret < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Peer {
+            pid: cred.pid as u32,
+            uid: cred.uid,
+        })
+    }
+}
+
+/// A shared mapping of the first `len` bytes of a file, unmapped on drop.
+struct Map {
+    ptr: *mut u8,
+    len: usize,
+}
+
+impl Map {
+    fn new(file: &File, len: usize, prot: libc::c_int) -> io::Result<Self> {
+        if len == 0 {
+            return Err(io::Error::new(io::ErrorKind::InvalidInput, "can't map 0 bytes"));
+        }
+        let ptr = unsafe {
+            libc::mmap(std::ptr::null_mut(), len, prot, libc::MAP_SHARED, file.as_raw_fd(), 0)
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Map { ptr: ptr as *mut u8, len })
+    }
+}
+
+impl Drop for Map {
+    fn drop(&mut self) {
+        unsafe { libc::munmap(self.ptr as *mut libc::c_void, self.len) };
+    }
+}
+
+/// A client's ring of fixed-size image slots in a shared-memory file.
+pub struct Ring {
+    file: File,
+    slot_len: usize,
+    slots: u32,
+
+    /// Read-write, for handing out disjoint mutable slots through `&self`.
+    map: Map,
+
+    free: parking_lot::Mutex<Vec<u32>>,
+}
+
+// Slots are handed out to one `Slot` at a time through `free`, so access through `map` never
+// aliases.
+unsafe impl Send for Ring {}
+unsafe impl Sync for Ring {}
+
+impl Ring {
+    /// Creates a ring of `slots` slots of `slot_len` bytes each in a new memfd.
+    pub fn new(slot_len: usize, slots: u32) -> io::Result<Arc<Self>> {
+        let len = slot_len.checked_mul(slots as usize)
+            .ok_or_else(|| io::Error::new(io::ErrorKind::InvalidInput, "ring too large"))?;
+        let fd = unsafe {
+            libc::memfd_create(b"nvr-analytics-ring\0".as_ptr() as *const libc::c_char,
+                               libc::MFD_CLOEXEC | libc::MFD_ALLOW_SEALING)
+        };
+        if fd < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let file = unsafe { File::from_raw_fd(fd) };
+        file.set_len(len as u64)?;
+
+        // Fix the size, so the server's mapping can't be truncated out from under it.
+        let seals = libc::F_SEAL_SHRINK | libc::F_SEAL_GROW | libc::F_SEAL_SEAL;
+        if unsafe { libc::fcntl(fd, libc::F_ADD_SEALS, seals) } < 0 {
+            return Err(io::Error::last_os_error());
+        }
+        let map = Map::new(&file, len, libc::PROT_READ | libc::PROT_WRITE)?;
+        Ok(Arc::new(Ring {
+            file,
+            slot_len,
+            slots,
+            map,
+            free: parking_lot::Mutex::new((0..slots).rev().collect()),
+        }))
+    }
+
+    /// The descriptor to pass to the server. It must stay open until the server has attached
+    /// it; the server's mapping remains valid after that.
+    pub fn fd(&self) -> RawFd { self.file.as_raw_fd() }
+    pub fn slot_len(&self) -> usize { self.slot_len }
+    pub fn slots(&self) -> u32 { self.slots }
+
+    /// Takes a free slot, if any. It's returned to the ring when dropped, so the caller should
+    /// keep it until the server has responded to the request which uses it.
+    pub fn try_acquire(self: &Arc<Self>) -> Option<Slot> {
+        let index = self.free.lock().pop()?;
+        Some(Slot {
+            ring: self.clone(),
+            index,
+        })
+    }
+}
+
+/// A slot of a `Ring`, held exclusively until dropped.
+pub struct Slot {
+    ring: Arc<Ring>,
+    index: u32,
+}
+
+impl Slot {
+    pub fn index(&self) -> u32 { self.index }
+
+    pub fn bytes_mut(&mut self) -> &mut [u8] {
+        let len = self.ring.slot_len;
+        debug_assert!(self.ring.map.len >= len * (self.index as usize + 1));
+        unsafe {
+            std::slice::from_raw_parts_mut(self.ring.map.ptr.add(self.index as usize * len), len)
+        }
+    }
+}
+
+impl Drop for Slot {
+    fn drop(&mut self) {
+        self.ring.free.lock().push(self.index);
+    }
+}
+
+/// The server's read-only mapping of a client's `Ring`.
+///
+/// The client may write to the memfd at any time; it's responsible for leaving each slot alone
+/// while the server is using it. It can't shrink the memfd, which would make the server's reads
+/// fault, so a misbehaving client can only garble its own images.
+pub struct Mapping {
+    /// Read-only.
+    map: Map,
+    slot_len: usize,
+    slots: u32,
+}
+
+// The mapping is only read.
+unsafe impl Send for Mapping {}
+unsafe impl Sync for Mapping {}
+
+impl Mapping {
+    /// Maps `peer`'s descriptor `fd`, which must be a memfd owned by the peer and sealed
+    /// against shrinking, as from `Ring::fd`.
+    pub fn open(peer: Peer, fd: RawFd, slot_len: usize, slots: u32) -> io::Result<Self> {
+        fn invalid(msg: String) -> io::Error { io::Error::new(io::ErrorKind::InvalidInput, msg) }
+        let path = PathBuf::from(format!("/proc/{}/fd/{}", peer.pid, fd));
+        let file = File::open(&path)?;
+        let metadata = file.metadata()?;
+        if metadata.uid() != peer.uid {
+            return Err(io::Error::new(io::ErrorKind::PermissionDenied,
+                                      format!("{} isn't owned by uid {}", path.display(),
+                                              peer.uid)));
+        }
+        let seals = unsafe { libc::fcntl(file.as_raw_fd(), libc::F_GET_SEALS) };
+        if seals < 0 || seals & libc::F_SEAL_SHRINK == 0 {
+            return Err(invalid(format!("{} isn't a memfd sealed against shrinking",
+                                       path.display())));
+        }
+        let len = slot_len.checked_mul(slots as usize)
+            .ok_or_else(|| invalid(format!("{} slots of {} is too large", slots, slot_len)))?;
+        if metadata.len() < len as u64 {
+            return Err(invalid(format!("{} is {} bytes; expected {} slots of {}",
+                                       path.display(), metadata.len(), slots, slot_len)));
+        }
+        let map = Map::new(&file, len, libc::PROT_READ)?;
+        Ok(Mapping {
+            map,
+            slot_len,
+            slots,
+        })
+    }
+
+    pub fn slot_len(&self) -> usize { self.slot_len }
+
+    /// Returns slot `index`, or `None` if it's out of range.
+    pub fn slot(&self, index: u32) -> Option<&[u8]> {
+        if index >= self.slots {
+            return None;
+        }
+        let start = index as usize * self.slot_len;
+        Some(unsafe { std::slice::from_raw_parts(self.map.ptr.add(start), self.slot_len) })
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use std::os::unix::io::AsRawFd;
+
+    #[test]
+    fn ring() {
+        let me = super::Peer { pid: std::process::id(), uid: unsafe { libc::getuid() } };
+        let ring = super::Ring::new(4, 2).unwrap();
+        let mut a = ring.try_acquire().unwrap();
+        let mut b = ring.try_acquire().unwrap();
+        assert!(ring.try_acquire().is_none());
+        a.bytes_mut().copy_from_slice(&[1, 2, 3, 4]);
+        b.bytes_mut().copy_from_slice(&[5, 6, 7, 8]);
+        let m = super::Mapping::open(me, ring.fd(), 4, 2).unwrap();
+        assert_eq!(m.slot(a.index()).unwrap(), &[1, 2, 3, 4]);
+        assert_eq!(m.slot(b.index()).unwrap(), &[5, 6, 7, 8]);
+        assert!(m.slot(2).is_none());
+        drop(a);
+        assert!(ring.try_acquire().is_some());
+
+        // Too many slots, or a file which could be truncated, are refused.
+        assert!(super::Mapping::open(me, ring.fd(), 4, 3).is_err());
+        let f = std::fs::File::open("Cargo.toml").unwrap();
+        assert!(super::Mapping::open(me, f.as_raw_fd(), 1, 1).is_err());
+    }
+}
@@ -0,0 +1,208 @@
+//! Writes detections as a WebVTT metadata track, as `viewer.html` displays.
+//!
+//! Each cue's text is an `Object` as JSON. By default, there's one cue per object per frame,
+//! lasting until the next frame. With coalescing, an object's cue instead lasts as long as
+//! each following frame has an object with the same label and a box overlapping the cue's by
+//! at least the given intersection over union (and, when tracking, the same track id). A parked
+//! car then becomes one cue rather than one per frame.
+
+use moonfire_ffmpeg::avutil::Rational;
+use serde::Serialize;
+use std::collections::BTreeMap;
+use std::io::Write;
+
+#[derive(Clone, Serialize)]
+pub struct Object<'a> {
+    pub label: &'a str,
+    pub score: f32,
+    pub x: f32,
+    pub y: f32,
+    pub w: f32,
+    pub h: f32,
+
+    /// The id of the object's track, when tracking.
+    #[serde(skip_serializing_if = "Option::is_none")]
+    pub track: Option<u64>,
+}
+
+impl<'a> Object<'a> {
+    /// Returns the intersection over union of two objects' boxes.
+    pub fn iou(&self, o: &Object) -> f32 {
+        let w = (self.x + self.w).min(o.x + o.w) - self.x.max(o.x);
+        let h = (self.y + self.h).min(o.y + o.h) - self.y.max(o.y);
+        if w <= 0. || h <= 0. {
+            return 0.;
+        }
+        let intersection = w * h;
+        intersection / (self.w * self.h + o.w * o.h - intersection)
+    }
+}
+
+struct Pts(i64, Rational);
+
+impl std::fmt::Display for Pts {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        // https://www.w3.org/TR/webvtt1/#webvtt-timestamp
+        let seconds = self.0 as f64 * self.1.num as f64 / self.1.den as f64;
+        let minutes = (seconds / 60.).trunc();
+        let seconds = seconds % 60.;
+        let hours = (minutes / 60.).trunc();
+        let minutes = minutes % 60.;
+        write!(f, "{:02.0}:{:02.0}:{:06.3}", hours, minutes, seconds)
+    }
+}
+
+struct Cue<'a> {
+    start: i64,
+    end: i64,
+    object: Object<'a>,
+}
+
+pub struct Writer<'a, W: Write> {
+    out: std::io::BufWriter<W>,
+    time_base: Rational,
+
+    /// The minimum intersection over union for an object to extend a cue, or `None` to never
+    /// extend cues.
+    coalesce_iou: Option<f32>,
+
+    /// Cues which may be extended by the next frame, with start times but not end times.
+    open: Vec<Cue<'a>>,
+
+    /// Cues which have ended but can't be written yet. WebVTT requires cues be ordered by start
+    /// time, so a cue can only be written once no open cue started before it. Keyed by start
+    /// time, then by the order they closed in.
+    closed: BTreeMap<(i64, u64), Cue<'a>>,
+
+    /// The number of cues closed so far, for `closed`'s keys.
+    next_seq: u64,
+}
+
+impl<'a, W: Write> Writer<'a, W> {
+    pub fn new(out: W, time_base: Rational, coalesce_iou: Option<f32>)
+               -> std::io::Result<Self> {
+        let mut out = std::io::BufWriter::with_capacity(1 << 16, out);
+        write!(out, "WEBVTT\n\n")?;
+        Ok(Writer {
+            out,
+            time_base,
+            coalesce_iou,
+            open: Vec::new(),
+            closed: BTreeMap::new(),
+            next_seq: 0,
+        })
+    }
+
+    /// Adds the objects detected in the frame at `pts`, which last until the next frame.
+    pub fn frame(&mut self, pts: i64, objects: &[Object<'a>]) -> std::io::Result<()> {
+        let mut open = Vec::with_capacity(objects.len());
+        for o in objects {
+            // Extend the open cue with the same label which best overlaps this object, if any.
+            let mut best = None;
+            if let Some(min_iou) = self.coalesce_iou {
+                let mut best_iou = min_iou;
+                for (i, c) in self.open.iter().enumerate() {
+                    if c.object.label != o.label || c.object.track != o.track {
+                        continue;
+                    }
+                    let iou = c.object.iou(o);
+                    if iou >= best_iou {
+                        best = Some(i);
+                        best_iou = iou;
+                    }
+                }
+            }
+            open.push(match best {
+                Some(i) => self.open.swap_remove(i),
+                None => Cue {
+                    start: pts,
+                    end: 0,
+                    object: o.clone(),
+                },
+            });
+        }
+
+        // Anything not extended ends here.
+        let open = std::mem::replace(&mut self.open, open);
+        self.close(open, pts);
+        let horizon = self.open.iter().map(|c| c.start).min().unwrap_or(pts);
+        self.write_closed(horizon)
+    }
+
+    /// Ends all cues at `end`, writes them, and flushes.
+    pub fn finish(mut self, end: i64) -> std::io::Result<()> {
+        let open = std::mem::take(&mut self.open);
+        self.close(open, end);
+        self.write_closed(i64::max_value())?;
+        self.out.flush()
+    }
+
+    /// Ends `cues` at `end`.
+    fn close(&mut self, cues: Vec<Cue<'a>>, end: i64) {
+        for mut c in cues {
+            c.end = end;
+            self.closed.insert((c.start, self.next_seq), c);
+            self.next_seq += 1;
+        }
+    }
+
+    /// Writes all closed cues which started before `horizon`.
+    fn write_closed(&mut self, horizon: i64) -> std::io::Result<()> {
+        let later = self.closed.split_off(&(horizon, 0));
+        for (_, c) in std::mem::replace(&mut self.closed, later) {
+            write!(self.out, "{} --> {}\n", Pts(c.start, self.time_base),
+                   Pts(c.end, self.time_base))?;
+            serde_json::to_writer(&mut self.out, &c.object)?;
+            write!(self.out, "\n\n")?;
+        }
+        Ok(())
+    }
+}
+
+#[cfg(test)]
+mod test {
+    use moonfire_ffmpeg::avutil::Rational;
+    use super::Object;
+
+    fn obj(label: &str, x: f32) -> Object {
+        Object { label, score: 0.75, x, y: 0., w: 0.5, h: 0.5, track: None }
+    }
+
+    fn write(coalesce_iou: Option<f32>, frames: &[&[Object]]) -> String {
+        let mut out = Vec::new();
+        let mut w = super::Writer::new(&mut out, Rational { num: 1, den: 1 }, coalesce_iou)
+            .unwrap();
+        for (i, f) in frames.iter().enumerate() {
+            w.frame(i as i64, f).unwrap();
+        }
+        w.finish(frames.len() as i64).unwrap();
+        String::from_utf8(out).unwrap()
+    }
+
+    #[test]
+    fn coalesce() {
+        let car = obj("car", 0.);
+        let moved = obj("car", 0.05);
+        let dog = obj("dog", 0.4);
+        let frames: [&[Object]; 3] = [&[car.clone(), dog.clone()], &[moved.clone()], &[moved]];
+
+        // Without coalescing, there's a cue per object per frame.
+        assert_eq!(write(None, &frames).matches(" --> ").count(), 4);
+
+        // With it, the car's cue lasts across all three frames.
+        assert_eq!(write(Some(0.5), &frames), "WEBVTT\n\n\
+            00:00:00.000 --> 00:00:01.000\n\
+            {\"label\":\"dog\",\"score\":0.75,\"x\":0.4,\"y\":0.0,\"w\":0.5,\"h\":0.5}\n\n\
+            00:00:00.000 --> 00:00:03.000\n\
+            {\"label\":\"car\",\"score\":0.75,\"x\":0.0,\"y\":0.0,\"w\":0.5,\"h\":0.5}\n\n");
+
+        // A cue which starts later but ends sooner waits for the longer one.
+        let frames: [&[Object]; 3] = [&[car.clone()], &[car.clone(), dog], &[car.clone()]];
+        let out = write(Some(0.5), &frames);
+        assert!(out.find("\"car\"").unwrap() < out.find("\"dog\"").unwrap());
+
+        // A box which moves too far starts a new cue.
+        let far = obj("car", 0.3);
+        assert_eq!(write(Some(0.5), &[&[car], &[far]]).matches(" --> ").count(), 2);
+    }
+}
@@ -0,0 +1,471 @@
+//! The backfill work queue (`backfill_work` in `schema.sql`) and where its results go.
+//!
+//! The queue and results live in one SQLite database. Processes on its host use it directly
+//! (`Queue::Local`); SQLite's locking doesn't work over network filesystems, so processes on
+//! other machines go through a `backfill --listen` process which serves it over gRPC
+//! (`Queue::Remote` and `service`). Either way, each worker leases the recordings it claims and
+//! renews the leases while working, so if it dies, its recordings are claimed by another.
+
+use failure::{Error, format_err};
+use parking_lot::Mutex;
+use rusqlite::params;
+use std::convert::TryFrom;
+use std::sync::Arc;
+use std::time::Duration;
+use uuid::Uuid;
+
+pub mod proto {
+    tonic::include_proto!("org.moonfire_nvr.backfill");
+}
+
+use proto::work_queue_client::WorkQueueClient;
+use proto::work_queue_server::{WorkQueue, WorkQueueServer};
+
+/// A stream, as keyed in the database.
+#[derive(Copy, Clone)]
+pub struct StreamKey<'a> {
+    pub camera_uuid: Uuid,
+    pub stream_name: &'a str,
+}
+
+/// An analyzed recording, ready to insert.
+pub struct Analyzed {
+    pub recording_id: i32,
+    pub frame_data: Vec<u8>,
+    pub frame_data_dictionary_id: Option<i64>,
+    pub durations: Vec<u8>,
+}
+
+pub enum Queue {
+    Local(Arc<Mutex<rusqlite::Connection>>),
+    Remote(WorkQueueClient<tonic::transport::Channel>),
+}
+
+impl Queue {
+    /// Adds the recordings `ids` (ascending) of `stream` to the queue, skipping any already
+    /// analyzed. Returns the rest.
+    pub async fn enqueue(&self, stream: StreamKey<'_>, ids: Vec<i32>, priority: i32)
+                         -> Result<Vec<i32>, Error> {
+        match self {
+            Queue::Local(c) => enqueue(&mut c.lock(), stream, ids, priority),
+            Queue::Remote(c) => Ok(c.clone().enqueue(proto::EnqueueRequest {
+                stream: Some(stream.into()),
+                recording_id: ids,
+                priority,
+            }).await?.into_inner().pending_recording_id),
+        }
+    }
+
+    /// Claims up to `per_stream` recordings of each of `streams` for `lease`, returning their
+    /// ids parallel to `streams`. Recordings are available if unclaimed or if their lease has
+    /// expired. Higher-priority recordings are claimed first.
+    pub async fn claim(&self, worker_id: &str, lease: Duration, streams: &[StreamKey<'_>],
+                       per_stream: usize) -> Result<Vec<Vec<i32>>, Error> {
+        match self {
+            Queue::Local(c) => claim(&mut c.lock(), worker_id, lease, streams, per_stream),
+            Queue::Remote(c) => Ok(c.clone().claim(proto::ClaimRequest {
+                worker_id: worker_id.to_owned(),
+                stream: streams.iter().map(|&s| s.into()).collect(),
+                per_stream: u32::try_from(per_stream)?,
+                lease_secs: lease.as_secs(),
+            }).await?.into_inner().claimed.into_iter().map(|c| c.recording_id).collect()),
+        }
+    }
+
+    /// Returns the number of queued recordings of `streams` leased by other workers.
+    pub async fn leased_by_others(&self, worker_id: &str, streams: &[StreamKey<'_>])
+                                  -> Result<i64, Error> {
+        match self {
+            Queue::Local(c) => leased_by_others(&c.lock(), worker_id, streams),
+            Queue::Remote(c) => Ok(c.clone().count_leased_by_others(
+                proto::CountLeasedByOthersRequest {
+                    worker_id: worker_id.to_owned(),
+                    stream: streams.iter().map(|&s| s.into()).collect(),
+                }).await?.into_inner().count),
+        }
+    }
+
+    /// Extends every lease `worker_id` holds to `lease` from now, returning how many it holds.
+    pub async fn renew(&self, worker_id: &str, lease: Duration) -> Result<u64, Error> {
+        match self {
+            Queue::Local(c) => renew(&c.lock(), worker_id, lease),
+            Queue::Remote(c) => Ok(c.clone().renew(proto::RenewRequest {
+                worker_id: worker_id.to_owned(),
+                lease_secs: lease.as_secs(),
+            }).await?.into_inner().renewed),
+        }
+    }
+
+    /// Returns a claimed recording to the queue, so it can be claimed again.
+    pub async fn release(&self, worker_id: &str, stream: StreamKey<'_>, id: i32)
+                         -> Result<(), Error> {
+        match self {
+            Queue::Local(c) => release(&c.lock(), worker_id, stream, id),
+            Queue::Remote(c) => {
+                c.clone().release(proto::ReleaseRequest {
+                    worker_id: worker_id.to_owned(),
+                    stream: Some(stream.into()),
+                    recording_id: id,
+                }).await?;
+                Ok(())
+            },
+        }
+    }
+
+    /// Inserts `recordings` and removes them from the queue, in one transaction.
+    pub async fn complete(&self, recordings: &[(StreamKey<'_>, &Analyzed)])
+                          -> Result<(), Error> {
+        match self {
+            Queue::Local(c) => complete(&mut c.lock(), recordings),
+            Queue::Remote(c) => {
+                c.clone().complete(proto::CompleteRequest {
+                    recording: recordings.iter().map(|(s, a)| proto::AnalyzedRecording {
+                        stream: Some((*s).into()),
+                        recording_id: a.recording_id,
+                        frame_data: a.frame_data.clone(),
+                        frame_data_dictionary_id: a.frame_data_dictionary_id.unwrap_or(0),
+                        durations: a.durations.clone(),
+                    }).collect(),
+                }).await?;
+                Ok(())
+            },
+        }
+    }
+
+    /// Gets the id and contents of the given zstd dictionary, or the newest if `id` is `None`.
+    pub async fn dictionary(&self, id: Option<i64>) -> Result<Option<(i64, Vec<u8>)>, Error> {
+        match self {
+            Queue::Local(c) => {
+                let conn = c.lock();
+                match id {
+                    Some(id) => Ok(Some((id, crate::dictionary::load(&conn, id)?))),
+                    None => crate::dictionary::load_newest(&conn),
+                }
+            },
+            Queue::Remote(c) => {
+                let resp = c.clone().get_dictionary(proto::GetDictionaryRequest {
+                    id: id.unwrap_or(0),
+                }).await?.into_inner();
+                Ok(if resp.id == 0 { None } else { Some((resp.id, resp.data)) })
+            },
+        }
+    }
+}
+
+impl<'a> From<StreamKey<'a>> for proto::Stream {
+    fn from(s: StreamKey<'a>) -> Self {
+        proto::Stream {
+            camera_uuid: s.camera_uuid.as_bytes()[..].to_owned(),
+            stream_name: s.stream_name.to_owned(),
+        }
+    }
+}
+
+/// Removes values from sorted Vec `from` if they are also in sorted Iterator `remove`.
+/// Takes O(from.len() + remove.len()) time.
+fn filter_sorted<'a, T: 'a + Ord, I: Iterator<Item = &'a T>>(from: &mut Vec<T>, mut remove: I) {
+    let mut cur_remove = remove.next();
+    from.retain(|e| {
+        while let Some(r) = cur_remove.as_ref() {
+            match e.cmp(r) {
+                std::cmp::Ordering::Less => return true,
+                std::cmp::Ordering::Equal => return false,
+                std::cmp::Ordering::Greater => cur_remove = remove.next(),
+            }
+        }
+        true
+    });
+}
+
+fn now_sec() -> i64 {
+    let now = std::time::SystemTime::now().duration_since(std::time::UNIX_EPOCH).unwrap();
+    i64::try_from(now.as_secs()).unwrap()
+}
+
+fn enqueue(conn: &mut rusqlite::Connection, stream: StreamKey<'_>, mut ids: Vec<i32>,
+           priority: i32) -> Result<Vec<i32>, Error> {
+    let (first, last) = match (ids.first(), ids.last()) {
+        (Some(&f), Some(&l)) => (f, l),
+        _ => return Ok(ids),
+    };
+    let u = stream.camera_uuid.as_bytes();
+
+    // Take the write lock up front so nothing is completed between the check and the insert.
+    let tx = conn.transaction_with_behavior(rusqlite::TransactionBehavior::Immediate)?;
+    {
+        let mut stmt = tx.prepare_cached(r#"
+            select
+              recording_id
+            from
+              recording_object_detection
+            where
+              camera_uuid = ? and
+              stream_name = ? and
+              ? <= recording_id and
+              recording_id <= ?
+            order by recording_id
+        "#)?;
+        let existing = stmt
+            .query_map(params![&u[..], stream.stream_name, first, last],
+                       |row| row.get::<_, i32>(0))?
+            .collect::<Result<Vec<i32>, rusqlite::Error>>()?;
+        filter_sorted(&mut ids, existing.iter());
+        let mut stmt = tx.prepare_cached(r#"
+            insert or ignore into backfill_work (camera_uuid, stream_name, recording_id, priority)
+                values (?, ?, ?, ?)
+        "#)?;
+        for &id in &ids {
+            stmt.execute(params![&u[..], stream.stream_name, id, priority])?;
+        }
+    }
+    tx.commit()?;
+    Ok(ids)
+}
+
+fn claim(conn: &mut rusqlite::Connection, worker_id: &str, lease: Duration,
+         streams: &[StreamKey<'_>], per_stream: usize) -> Result<Vec<Vec<i32>>, Error> {
+    let now = now_sec();
+    let expires = now + i64::try_from(lease.as_secs())?;
+    let per_stream = i64::try_from(per_stream)?;
+    let mut claimed = Vec::with_capacity(streams.len());
+
+    // Take the write lock up front so concurrent claimers don't select the same rows.
+    let tx = conn.transaction_with_behavior(rusqlite::TransactionBehavior::Immediate)?;
+    {
+        let mut select = tx.prepare_cached(r#"
+            select
+              recording_id
+            from
+              backfill_work
+            where
+              camera_uuid = ? and
+              stream_name = ? and
+              (lease_owner is null or lease_expires_sec < ?)
+            order by priority desc, recording_id
+            limit ?
+        "#)?;
+        let mut update = tx.prepare_cached(r#"
+            update backfill_work
+            set
+              lease_owner = ?,
+              lease_expires_sec = ?
+            where
+              camera_uuid = ? and
+              stream_name = ? and
+              recording_id = ?
+        "#)?;
+        for s in streams {
+            let u = s.camera_uuid.as_bytes();
+            let ids = select
+                .query_map(params![&u[..], s.stream_name, now, per_stream],
+                           |row| row.get::<_, i32>(0))?
+                .collect::<Result<Vec<i32>, rusqlite::Error>>()?;
+            for &id in &ids {
+                update.execute(params![worker_id, expires, &u[..], s.stream_name, id])?;
+            }
+            claimed.push(ids);
+        }
+    }
+    tx.commit()?;
+    Ok(claimed)
+}
+
+fn leased_by_others(conn: &rusqlite::Connection, worker_id: &str, streams: &[StreamKey<'_>])
+                    -> Result<i64, Error> {
+    let mut stmt = conn.prepare_cached(r#"
+        select
+          count(*)
+        from
+          backfill_work
+        where
+          camera_uuid = ? and
+          stream_name = ? and
+          lease_owner != ?
+    "#)?;
+    let mut total = 0;
+    for s in streams {
+        let u = s.camera_uuid.as_bytes();
+        total += stmt.query_row(params![&u[..], s.stream_name, worker_id],
+                                |row| row.get::<_, i64>(0))?;
+    }
+    Ok(total)
+}
+
+fn renew(conn: &rusqlite::Connection, worker_id: &str, lease: Duration) -> Result<u64, Error> {
+    let expires = now_sec() + i64::try_from(lease.as_secs())?;
+    let mut stmt = conn.prepare_cached(r#"
+        update backfill_work set lease_expires_sec = ? where lease_owner = ?
+    "#)?;
+    Ok(u64::try_from(stmt.execute(params![expires, worker_id])?)?)
+}
+
+fn release(conn: &rusqlite::Connection, worker_id: &str, stream: StreamKey<'_>, id: i32)
+           -> Result<(), Error> {
+    let mut stmt = conn.prepare_cached(r#"
+        update backfill_work
+        set
+          lease_owner = null,
+          lease_expires_sec = null
+        where
+          camera_uuid = ? and
+          stream_name = ? and
+          recording_id = ? and
+          lease_owner = ?
+    "#)?;
+    let u = stream.camera_uuid.as_bytes();
+    stmt.execute(params![&u[..], stream.stream_name, id, worker_id])?;
+    Ok(())
+}
+
+fn complete(conn: &mut rusqlite::Connection, recordings: &[(StreamKey<'_>, &Analyzed)])
+            -> Result<(), Error> {
+    let tx = conn.transaction()?;
+    {
+        // If a worker's lease expired, another may have analyzed the recording too.
+        // The results should be the same, so keep whichever was first.
+        let mut insert = tx.prepare_cached(r#"
+            insert or ignore into recording_object_detection (camera_uuid, stream_name,
+                                                              recording_id, frame_data,
+                                                              frame_data_dictionary_id,
+                                                              durations)
+                values (?, ?, ?, ?, ?, ?)
+        "#)?;
+        let mut delete = tx.prepare_cached(r#"
+            delete from backfill_work
+            where camera_uuid = ? and stream_name = ? and recording_id = ?
+        "#)?;
+        for (s, a) in recordings {
+            let u = s.camera_uuid.as_bytes();
+            insert.execute(params![&u[..], s.stream_name, &a.recording_id, &a.frame_data,
+                                   &a.frame_data_dictionary_id, &a.durations])?;
+            delete.execute(params![&u[..], s.stream_name, &a.recording_id])?;
+        }
+    }
+    tx.commit()?;
+    Ok(())
+}
+
+/// Serves `conn`'s queue to `Queue::Remote` workers.
+pub fn service(conn: Arc<Mutex<rusqlite::Connection>>) -> WorkQueueServer<Server> {
+    WorkQueueServer::new(Server(conn))
+}
+
+pub struct Server(Arc<Mutex<rusqlite::Connection>>);
+
+fn internal(e: Error) -> tonic::Status { tonic::Status::internal(e.to_string()) }
+
+fn parse_stream(s: &proto::Stream) -> Result<StreamKey<'_>, tonic::Status> {
+    let camera_uuid = Uuid::from_slice(&s.camera_uuid)
+        .map_err(|e| tonic::Status::invalid_argument(format!("bad camera_uuid: {}", e)))?;
+    Ok(StreamKey { camera_uuid, stream_name: &s.stream_name })
+}
+
+fn required(s: &Option<proto::Stream>) -> Result<StreamKey<'_>, tonic::Status> {
+    parse_stream(s.as_ref().ok_or_else(|| tonic::Status::invalid_argument("stream required"))?)
+}
+
+#[tonic::async_trait]
+impl WorkQueue for Server {
+    async fn enqueue(&self, req: tonic::Request<proto::EnqueueRequest>)
+                     -> Result<tonic::Response<proto::EnqueueResponse>, tonic::Status> {
+        let req = req.into_inner();
+        let stream = required(&req.stream)?;
+        let pending = enqueue(&mut self.0.lock(), stream, req.recording_id, req.priority)
+            .map_err(internal)?;
+        Ok(tonic::Response::new(proto::EnqueueResponse { pending_recording_id: pending }))
+    }
+
+    async fn claim(&self, req: tonic::Request<proto::ClaimRequest>)
+                   -> Result<tonic::Response<proto::ClaimResponse>, tonic::Status> {
+        let req = req.into_inner();
+        let streams = req.stream.iter().map(parse_stream).collect::<Result<Vec<_>, _>>()?;
+        let claimed = claim(&mut self.0.lock(), &req.worker_id,
+                            Duration::from_secs(req.lease_secs), &streams,
+                            usize::try_from(req.per_stream).unwrap())
+            .map_err(internal)?;
+        Ok(tonic::Response::new(proto::ClaimResponse {
+            claimed: claimed.into_iter()
+                            .map(|ids| proto::RecordingIds { recording_id: ids })
+                            .collect(),
+        }))
+    }
+
+    async fn count_leased_by_others(&self, req: tonic::Request<proto::CountLeasedByOthersRequest>)
+        -> Result<tonic::Response<proto::CountLeasedByOthersResponse>, tonic::Status> {
+        let req = req.into_inner();
+        let streams = req.stream.iter().map(parse_stream).collect::<Result<Vec<_>, _>>()?;
+        let count = leased_by_others(&self.0.lock(), &req.worker_id, &streams)
+            .map_err(internal)?;
+        Ok(tonic::Response::new(proto::CountLeasedByOthersResponse { count }))
+    }
+
+    async fn renew(&self, req: tonic::Request<proto::RenewRequest>)
+                   -> Result<tonic::Response<proto::RenewResponse>, tonic::Status> {
+        let req = req.into_inner();
+        let renewed = renew(&self.0.lock(), &req.worker_id, Duration::from_secs(req.lease_secs))
+            .map_err(internal)?;
+        Ok(tonic::Response::new(proto::RenewResponse { renewed }))
+    }
+
+    async fn release(&self, req: tonic::Request<proto::ReleaseRequest>)
+                     -> Result<tonic::Response<proto::ReleaseResponse>, tonic::Status> {
+        let req = req.into_inner();
+        let stream = required(&req.stream)?;
+        release(&self.0.lock(), &req.worker_id, stream, req.recording_id).map_err(internal)?;
+        Ok(tonic::Response::new(proto::ReleaseResponse {}))
+    }
+
+    async fn complete(&self, req: tonic::Request<proto::CompleteRequest>)
+                      -> Result<tonic::Response<proto::CompleteResponse>, tonic::Status> {
+        let req = req.into_inner();
+        let mut streams = Vec::with_capacity(req.recording.len());
+        let mut analyzed = Vec::with_capacity(req.recording.len());
+        for r in &req.recording {
+            streams.push(required(&r.stream)?);
+            analyzed.push(Analyzed {
+                recording_id: r.recording_id,
+                frame_data: r.frame_data.clone(),
+                frame_data_dictionary_id: match r.frame_data_dictionary_id {
+                    0 => None,
+                    id => Some(id),
+                },
+                durations: r.durations.clone(),
+            });
+        }
+        let recordings: Vec<_> = streams.into_iter().zip(analyzed.iter()).collect();
+        complete(&mut self.0.lock(), &recordings).map_err(internal)?;
+        Ok(tonic::Response::new(proto::CompleteResponse {}))
+    }
+
+    async fn get_dictionary(&self, req: tonic::Request<proto::GetDictionaryRequest>)
+                            -> Result<tonic::Response<proto::GetDictionaryResponse>,
+                                      tonic::Status> {
+        let id = req.into_inner().id;
+        let conn = self.0.lock();
+        let d = match id {
+            0 => crate::dictionary::load_newest(&conn).map_err(internal)?,
+            id => Some((id, crate::dictionary::load(&conn, id).map_err(|e| {
+                tonic::Status::not_found(format!("dictionary {}: {}", id, e))
+            })?)),
+        };
+        let (id, data) = d.unwrap_or((0, Vec::new()));
+        Ok(tonic::Response::new(proto::GetDictionaryResponse { id, data }))
+    }
+}
+
+/// Connects to a `backfill --listen` process at `url`.
+pub async fn connect(url: String) -> Result<Queue, Error> {
+    let client = WorkQueueClient::connect(url.clone()).await
+        .map_err(|e| format_err!("unable to connect to {}: {}", url, e))?;
+    Ok(Queue::Remote(client))
+}
+
+#[cfg(test)]
+mod test {
+    #[test]
+    fn filter() {
+        let mut from = vec![1, 3, 5, 10, 20];
+        super::filter_sorted(&mut from, [1, 2, 3, 8, 20].iter());
+        assert_eq!(&from, &[5, 10]);
+    }
+}